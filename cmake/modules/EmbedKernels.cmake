@@ -0,0 +1,23 @@
+# Writes the OpenCL sources SOURCE_DIR/<name>.cl for every name in the comma
+# separated list KERNELS into the C++ file OUTPUT, as the strings declared in
+# core/KernelSources.hpp. Run with cmake -P.
+
+string(REPLACE "," ";" KERNELS "${KERNELS}")
+
+set(CONTENTS "// generated by EmbedKernels.cmake, do not edit\n\n")
+set(CONTENTS "${CONTENTS}#include \"core/KernelSources.hpp\"\n\n")
+set(CONTENTS "${CONTENTS}namespace Feldrand {\n")
+foreach(KERNEL ${KERNELS})
+  file(READ ${SOURCE_DIR}/${KERNEL}.cl SOURCE)
+  set(CONTENTS
+    "${CONTENTS}const char* const ${KERNEL}_cl = R\"FELDRAND_CL(${SOURCE})FELDRAND_CL\";\n\n")
+endforeach()
+set(CONTENTS "${CONTENTS}}\n")
+
+# only touch OUTPUT when it changes, to avoid needless rebuilds
+if(EXISTS ${OUTPUT})
+  file(READ ${OUTPUT} OLD_CONTENTS)
+endif()
+if(NOT "${OLD_CONTENTS}" STREQUAL "${CONTENTS}")
+  file(WRITE ${OUTPUT} "${CONTENTS}")
+endif()
@@ -19,6 +19,7 @@ with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #define FELDRAND__BGK_OCL_HPP
 
 #include "core/SimulationImplementation.hpp"
+#include <map>
 #include "OpenClHelper/OpenCLHelper.h"
 #include "OpenClHelper/CLKernel.h"
 
@@ -28,44 +29,201 @@ namespace Feldrand {
 
 	class BGK_OCL : public Simulation::SimulationImplementation {
 	public:
+		/* passed as device, splits the grid across every OpenCL device */
+		static const int all_devices = -1;
+
+		/* With hybrid set, host threads simulate the lowest rows of the
+		 * grid alongside the device, which must not be all_devices. */
 		BGK_OCL();
-        BGK_OCL(std::string filename);
+        BGK_OCL(std::string filename, int device = 0, bool hybrid = false);
 		BGK_OCL(double width, double height,
-				size_t grid_width, size_t grid_height);
+				size_t grid_width, size_t grid_height, int device = 0,
+				bool hybrid = false);
 		BGK_OCL(BGK_OCL& other);
 		virtual ~BGK_OCL();
+
+		/* the number of OpenCL devices that can be passed as device, 0 if
+		 * there is no usable OpenCL runtime */
+		static int devices();
 	protected:
 		void init();
 		void one_iteration();
+		void iterate(size_t steps);
+		auto lattice_viscosity() -> double;
+		auto timesteps_per_iteration() -> size_t;
 		void do_clear();
 		void do_draw(int x, int y,
 					 std::shared_ptr<const Grid<mask_t>> mask_ptr,
 					 cell_t type);
-		auto get_velocity_grid() -> Grid<Vec2D<float>>*;
-		auto get_density_grid()  -> Grid<float>*;
-		auto get_type_grid()     -> Grid<cell_t>*;
+		void get_fields(Grid<Vec2D<float>>* velocity,
+						Grid<float>* density,
+						Grid<cell_t>* types);
 		void write_data(std::ostream& dest);
 		void read_data(std::istream& src);
+		void do_streaming(streaming_t mode);
 		
 	private:
-		void setFields(const size_t ix, const size_t iy, 
-					   const float* val, const int type);
-
-		CLKernel* getVelocityKernel;
-		CLKernel* getDensityKernel;
-		CLKernel* simulationStepKernel;
-		OpenCLHelper* cl;
-		CLArrayFloat* dst[9];
-		CLArrayFloat* src[9];
-		CLArrayInt* flag_field;
-
-		size_t global_size[2];
+		/* A horizontal band of the grid, simulated on a device of its own.
+		 * It owns the rows [first, last) and holds halo rows beyond each
+		 * boundary with another slab, which exchange() copies from there.
+		 * Its device arrays use the layout of simulationStep.cl for a grid
+		 * of height rows, the first of which is row top of the whole grid. */
+		struct Slab {
+			cl_device_id device = NULL;
+			cl_command_queue queue = NULL;
+			/* downloads and the halo copies into the slab go through queues
+			 * of their own, so they need not wait for unrelated kernels */
+			cl_command_queue read_queue = NULL;
+			cl_command_queue copy_queue = NULL;
+			size_t top = 0;
+			size_t height = 0;
+			size_t first = 0;
+			size_t last = 0;
+			/* all nine population planes of a grid in one buffer, dst is
+			 * only allocated for streaming_t::TWO_GRID */
+			cl_mem src = NULL;
+			cl_mem dst = NULL;
+			cl_mem flags = NULL;
+			/* the neighbor types of each cell, computed from the flags on
+			 * the device */
+			cl_mem links = NULL;
+			/* x and y offset of each local_size tile that is simulated,
+			 * split into the EDGE tiles, which compute or feed the rows
+			 * exchanged with a neighbor, and the INNER ones */
+			cl_mem tiles[2] = {NULL, NULL};
+			size_t active_tiles[2] = {0, 0};
+			/* every specialization of simulationStep.cl built so far, by
+			 * build options, and the options of step_program */
+			std::map<std::string, cl_program> step_programs;
+			std::string step_options;
+			cl_program step_program = NULL;
+			/* step_kernel[0] streams src into dst, step_kernel[1] dst into
+			 * src, step_aa_kernel[odd] runs the even or odd in place step,
+			 * each in one instance per tile list. Their arguments are set
+			 * by bind_step_kernels() and only set again after
+			 * set_local_size() or do_streaming() replaced a buffer, not
+			 * when update_tiles() rewrites the tile lists in place. */
+			cl_kernel step_kernel[2][2] = {{NULL, NULL}, {NULL, NULL}};
+			cl_kernel step_aa_kernel[2][2] = {{NULL, NULL}, {NULL, NULL}};
+			cl_kernel links_kernel = NULL;
+			bool step_kernels_bound = false;
+			/* the brush applied by do_draw(), and its mask */
+			cl_program draw_program = NULL;
+			cl_kernel draw_kernel = NULL;
+			cl_mem mask_buffer = NULL;
+			size_t mask_capacity = 0;
+			/* the halo copies the next kernel on queue has to wait for */
+			std::vector<cl_event> wait;
+			/* completes with the EDGE tiles of a step before exchange(),
+			 * and with the last halo copy into the slab */
+			cl_event edge = NULL;
+			cl_event copied = NULL;
+			/* with profiled set, the events of the step kernels of the
+			 * batch iterate() enqueues, and those of the batch before,
+			 * which computed settling_rows rows settling_steps times, until
+			 * they are done */
+			bool profiled = false;
+			std::vector<cl_event> timed;
+			std::vector<cl_event> settling;
+			size_t settling_rows = 0;
+			size_t settling_steps = 0;
+		};
+		enum { EDGE = 0, INNER = 1 };
+
+		void create_slabs();
+		void release_slab(Slab& slab);
+		void update_tiles();
+		void update_links(Slab& slab, int left, int top, size_t w, size_t h);
+		/* layout of the host flags, and of the device arrays of slab, see
+		 * simulationStep.cl */
+		size_t cell(size_t x, size_t y) const { return y * pitch + x; }
+		size_t plane(const Slab& slab) const { return pitch * slab.height; }
+		std::vector<float> initial_fields(size_t top, size_t height) const;
+		void upload_fields(Slab& slab);
+		void set_local_size(size_t x, size_t y);
+		/* builds source for device, or loads the binary cached by an
+		 * earlier build */
+		cl_program build_program(cl_device_id device, const std::string& name,
+								 const char* source,
+								 const std::string& options = "");
+		void build_kernels();
+		void specialize(Slab& slab);
+		void release_step_kernels(Slab& slab);
+		void bind_step_kernels(Slab& slab);
+		void enqueue(Slab& slab, cl_kernel kernel, const size_t* launch_size,
+					 const size_t* local, cl_event* event);
+		void enqueue_tiles(Slab& slab, cl_kernel kernel, int part,
+						   cl_event* event);
+		void enqueue_step(bool exchanging, std::vector<cl_event>* events);
+		void exchange();
+		/* the hybrid backend's share of the host, see host_first */
+		void host_step();
+		void exchange_host();
+		void balance();
+		void measure(size_t steps);
+		void move_boundary(size_t first);
+		double busy_time(std::vector<cl_event>& events);
+		/* waits for the steps enqueued by iterate() */
+		void sync();
+		void upload_mask(std::shared_ptr<const Grid<mask_t>> mask_ptr);
+		/* pick the fastest local size for simulationStep, either from the
+		 * tuning cache or by timing each candidate */
+		void tune();
+		std::string device_key(cl_device_id device);
+
+		/* a macroscopic field computed by kernel into buffer, both per
+		 * slab, and read back through the mapped pinned buffer at host */
+		struct Field {
+			std::vector<cl_program> program;
+			std::vector<cl_kernel> kernel;
+			std::vector<cl_mem> buffer;
+			cl_mem pinned = NULL;
+			void* host = NULL;
+			size_t cell_size = 0;
+		};
+		void create_field(Field& field, const char* source,
+						  const char* kernel, size_t cell_size);
+		void release_field(Field& field);
+		void download(Field& field, void* dest);
+
+		int device;
+		bool hybrid;
+		cl_context context;
+		/* top to bottom, one per device */
+		std::vector<Slab> slabs;
+		Field velocity_field;
+		Field density_field;
+		/* velocity and density of getFields, interleaved */
+		Field moments_field;
+		int step_parity;
+		/* timesteps since the last exchange() */
+		size_t unexchanged;
+		/* completes with the last steps and halo copies of the most recent
+		 * iterate() */
+		std::vector<cl_event> pending;
+		/* the mask last uploaded to the slabs */
+		std::shared_ptr<const Grid<mask_t>> drawn_mask;
+		/* the flags are kept on the host as well, no kernel but drawMask
+		 * writes them, and do_draw() mirrors that */
+		std::vector<int> flags;
+		/* With hybrid set, host threads simulate the rows [host_first,
+		 * gridHeight) on host_src and host_dst, copies of the whole grid in
+		 * the layout of the device arrays, and the single slab holds the
+		 * whole grid as well but simulates the rows above. The costs are
+		 * the smoothed seconds per row each side needs for its steps. */
+		size_t host_first;
+		std::vector<float> host_src;
+		std::vector<float> host_dst;
+		std::vector<int> host_links;
+		double host_busy;
+		double host_cost;
+		double device_cost;
+		streaming_t streaming;
+
+		size_t pitch;
 		size_t local_size[2];
 
         std::vector<unsigned char> image;
-      
-		std::vector<float> vel;
-		std::vector<float> density;
 	};
 }
 #endif // FELDRAND__BGK_OCL_HPP
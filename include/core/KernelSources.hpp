@@ -0,0 +1,30 @@
+/* Copyright (C) 2013  Dominik Ernst
+
+This file is part of Feldrand.
+
+Feldrand is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more
+details.
+
+You should have received a copy of the GNU Affero General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FELDRAND__KERNEL_SOURCES_HPP
+#define FELDRAND__KERNEL_SOURCES_HPP
+
+namespace Feldrand {
+	/* The OpenCL programs in src/core, embedded into the library at build
+	 * time by cmake/modules/EmbedKernels.cmake. */
+	extern const char* const simulationStep_cl;
+	extern const char* const getVelocity_cl;
+	extern const char* const getDensity_cl;
+	extern const char* const getFields_cl;
+	extern const char* const drawMask_cl;
+}
+#endif // FELDRAND__KERNEL_SOURCES_HPP
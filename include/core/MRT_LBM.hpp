@@ -18,38 +18,108 @@ with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #ifndef FELDRAND__MRT_LBM_HPP
 #define FELDRAND__MRT_LBM_HPP
 
+#include <cstdint>
+#include <vector>
 #include "core/SimulationImplementation.hpp"
+#include "core/PlaneGrid.hpp"
 
 namespace Feldrand {
 
+	/* The collision operators of the CPU solver. Each one is a policy with
+	 * a single static member template collide(Pack<Real> f[9]), defined in
+	 * MRT_LBM.cpp and fully inlined into the sweeps. BGK relaxes all
+	 * populations with one rate, TRT relaxes their symmetric and
+	 * antisymmetric parts separately and MRT relaxes each moment on its
+	 * own. BGK is the cheapest, MRT the most stable. */
+	struct BGK;
+	struct TRT;
+	struct MRT;
 
-
-	
-
-	class MRT_LBM : public Simulation::SimulationImplementation {
+	/* The CPU solver, for every collision policy and for float or double
+	 * populations. All six combinations are instantiated in MRT_LBM.cpp. */
+	template<typename Collision, typename Real = float>
+	class CPU_LBM : public Simulation::SimulationImplementation {
 	public:
-		MRT_LBM();
-		MRT_LBM(double width, double height,
+		CPU_LBM();
+		CPU_LBM(double width, double height,
 				size_t grid_width, size_t grid_height);
-		MRT_LBM(MRT_LBM& other);
-		virtual ~MRT_LBM();
+		CPU_LBM(CPU_LBM& other);
+		virtual ~CPU_LBM();
 	protected:
 		void init();
 		void one_iteration();
+		void iterate(size_t steps);
+		auto lattice_viscosity() -> double;
+		auto timesteps_per_iteration() -> size_t;
 		void do_clear();
 		void do_draw(int x, int y,
 					 std::shared_ptr<const Grid<mask_t>> mask_ptr,
 					 cell_t type);
-		auto get_velocity_grid() -> Grid<Vec2D<float>>*;
-		auto get_density_grid()  -> Grid<float>*;
-		auto get_type_grid()     -> Grid<cell_t>*;
+		void get_fields(Grid<Vec2D<float>>* velocity,
+						Grid<float>* density,
+						Grid<cell_t>* types);
 		void write_data(std::ostream& dest);
 		void read_data(std::istream& src);
-		void stream();
-		void collide();
+		void do_streaming(streaming_t mode);
+		void do_blocking(size_t block_height, size_t temporal_depth);
+		void do_threads(size_t count, affinity_t affinity);
+		void stream_collide(PlaneGrid<Real, 9>& in, PlaneGrid<Real, 9>& out,
+							size_t first_row, size_t last_row);
+		void wavefront(size_t steps);
+		void aa_even_step();
+		void aa_odd_step();
+
+		/* Calls touch(y) for every row y of the grids, from -1 to
+		 * gridHeight, on the thread of the calling thread's OpenMP team
+		 * that updates the row in iterate(). Grids whose rows are first
+		 * written this way, by the work thread, have their pages on the
+		 * NUMA nodes of the threads that use them. */
+		template<typename Touch>
+		void for_each_row(Touch touch);
+		/* moves the grids to fresh ones, written by for_each_row() */
+		void place_grids();
+		void set_cell(size_t x, size_t y, const Cell& cell);
+		void update_links();
+		/* index of the tile containing cell (x, y) in active_tiles */
+		size_t tile(size_t x, size_t y) const;
 
-		Grid<Cell> src;
-		Grid<Cell> dest;
+		/* A link connects a fluid cell to a neighbor that is not updated.
+		 * wall and cell are PlaneGrid::index()es of the population the cell
+		 * pulls from the neighbor and of the cell's own opposite population,
+		 * saved is the value the neighbor holds in wall. */
+		struct Link {
+			size_t wall;
+			size_t cell;
+			Real saved;
+		};
+
+		/* one plane per D2Q9 direction, ordered like the members of Cell.
+		 * dest is only allocated for streaming_t::TWO_GRID. */
+		PlaneGrid<Real, 9> src;
+		PlaneGrid<Real, 9> dest;
+		/* the cell_t of each cell, as a single byte */
+		PlaneGrid<uint8_t, 1> flags;
+		/* links to obstacles and to the other cells that are not updated,
+		 * rebuilt by update_links() whenever the geometry changes */
+		std::vector<Link> no_slip_links;
+		std::vector<Link> passive_links;
+		/* the no_slip_links of the cells in row y start at no_slip_rows[y] */
+		std::vector<size_t> no_slip_rows;
+		/* one entry per tile of the grid (padding columns included), set if
+		 * the tile holds a cell that is updated. The sweeps skip the other
+		 * tiles, which is why their populations are kept equal in src and
+		 * dest. Rebuilt by update_links(). The skipped tiles keep their
+		 * dense storage, so that rows stay contiguous for the sweeps. */
+		std::vector<uint8_t> active_tiles;
+		size_t tiles_x;
+		streaming_t streaming;
+		/* see Simulation::blocking_data */
+		size_t block_height;
+		size_t temporal_depth;
 	};
+
+	typedef CPU_LBM<BGK> BGK_LBM;
+	typedef CPU_LBM<TRT> TRT_LBM;
+	typedef CPU_LBM<MRT> MRT_LBM;
 }
 #endif // FELDRAND__MRT_LBM_HPP
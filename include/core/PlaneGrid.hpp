@@ -0,0 +1,183 @@
+/* Copyright (C) 2013  Marco Heisig
+
+This file is part of Feldrand.
+
+Feldrand is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more
+details.
+
+You should have received a copy of the GNU Affero General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FELDRAND__PLANE_GRID_HPP
+#define FELDRAND__PLANE_GRID_HPP
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+namespace Feldrand {
+
+/* A structure of arrays counterpart to Grid<T>. It stores Planes separate
+ * x times y arrays ("planes"), e.g. one for each lattice direction.
+ *
+ * Each row is padded to a multiple of 64 bytes and every plane starts at a
+ * 64 byte boundary, so row(p, y) can always be processed with aligned vector
+ * loads and stores. Every plane carries one additional padding row above
+ * and below the grid so that neighbour accesses of the outermost rows (and
+ * one element left of the first and right of the last column) stay inside
+ * the allocation. */
+template<typename T, size_t Planes>
+class PlaneGrid {
+public:
+    static const size_t alignment = 64;
+    static const size_t planes = Planes;
+
+    PlaneGrid()
+        : _x(0), _y(0), _pitch(0), _plane_size(0),
+          _memory(nullptr), _data(nullptr) {}
+
+    PlaneGrid(size_t x, size_t y)
+        : _x(x), _y(y),
+          _pitch(round_up(x, alignment / sizeof(T))),
+          _plane_size(_pitch * (y + 2)) {
+        /* the memory is deliberately left untouched, so that the first
+         * write decides where its pages are placed */
+        _memory = new char[Planes * _plane_size * sizeof(T) + alignment];
+        uintptr_t addr = reinterpret_cast<uintptr_t>(_memory);
+        addr = (addr + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        _data = reinterpret_cast<T*>(addr);
+    }
+
+    /* copies are first touched row by row, like fill() */
+    PlaneGrid(const PlaneGrid& other)
+        : PlaneGrid(other._x, other._y) {
+#pragma omp parallel for schedule(static)
+        for(ptrdiff_t y = -1; y <= (ptrdiff_t)_y; ++y) {
+            copy_row(other, y);
+        }
+    }
+
+    PlaneGrid(PlaneGrid&& other) noexcept
+        : _x(other._x), _y(other._y),
+          _pitch(other._pitch), _plane_size(other._plane_size),
+          _memory(other._memory), _data(other._data) {
+        other._memory = nullptr;
+        other._data = nullptr;
+    }
+
+    PlaneGrid& operator=(PlaneGrid&& other) noexcept {
+        delete[] _memory;
+        _x = other._x;
+        _y = other._y;
+        _pitch = other._pitch;
+        _plane_size = other._plane_size;
+        _memory = other._memory;
+        _data = other._data;
+        other._memory = nullptr;
+        other._data = nullptr;
+        return *this;
+    }
+
+    PlaneGrid& operator=(const PlaneGrid&) = delete;
+
+    ~PlaneGrid() {
+        delete[] _memory;
+    }
+
+    inline T& operator() (size_t p, size_t x, size_t y) {
+        return row(p, y)[x];
+    }
+
+    inline const T& operator() (size_t p, size_t x, size_t y) const {
+        return row(p, y)[x];
+    }
+
+    /* pointer to the first element of row y of plane p, y may range from
+     * -1 to this->y() (the padding rows) */
+    inline T* row(size_t p, ptrdiff_t y) {
+        return _data + p * _plane_size + (y + 1) * _pitch;
+    }
+
+    inline const T* row(size_t p, ptrdiff_t y) const {
+        return _data + p * _plane_size + (y + 1) * _pitch;
+    }
+
+    inline T* plane(size_t p) { return row(p, 0); }
+    inline const T* plane(size_t p) const { return row(p, 0); }
+
+    /* position of element (x, y) of plane p relative to data(), the same
+     * for every grid of equal size */
+    inline size_t index(size_t p, ptrdiff_t x, ptrdiff_t y) const {
+        return p * _plane_size + (y + 1) * _pitch + x;
+    }
+
+    inline T* data() { return _data; }
+    inline const T* data() const { return _data; }
+
+    /* set every element, including the padding, of all planes. The rows
+     * are distributed over the OpenMP threads by a single row loop with
+     * schedule(static), so on a fresh grid each page is placed on the NUMA
+     * node of the thread that first wrote it. Solvers that split the rows
+     * differently place their grids with fill_row() or copy_row(). */
+    void fill(const T& value) {
+#pragma omp parallel for schedule(static)
+        for(ptrdiff_t y = -1; y <= (ptrdiff_t)_y; ++y) {
+            fill_row(y, value);
+        }
+    }
+
+    /* set or copy row y, from -1 to y(), of every plane, padding included.
+     * other must have the same size. */
+    void fill_row(ptrdiff_t y, const T& value) {
+        for(size_t p = 0; p < Planes; ++p) {
+            T* to = row(p, y);
+            for(size_t x = 0; x < _pitch; ++x) to[x] = value;
+        }
+    }
+
+    void copy_row(const PlaneGrid& other, ptrdiff_t y) {
+        for(size_t p = 0; p < Planes; ++p) {
+            const T* from = other.row(p, y);
+            T* to = row(p, y);
+            for(size_t x = 0; x < _pitch; ++x) to[x] = from[x];
+        }
+    }
+
+    static void swap(PlaneGrid& g1, PlaneGrid& g2) {
+        assert (g1._x == g2._x);
+        assert (g1._y == g2._y);
+        char* tmp_memory = g1._memory;
+        T* tmp_data = g1._data;
+        g1._memory = g2._memory;
+        g1._data = g2._data;
+        g2._memory = tmp_memory;
+        g2._data = tmp_data;
+    }
+
+    inline size_t x() const { return _x; }
+    inline size_t y() const { return _y; }
+    /* distance between two successive rows, in elements */
+    inline size_t pitch() const { return _pitch; }
+
+private:
+    static size_t round_up(size_t value, size_t quantum) {
+        if(quantum == 0) return value;
+        return ((value + quantum - 1) / quantum) * quantum;
+    }
+
+    size_t _x;
+    size_t _y;
+    size_t _pitch;
+    size_t _plane_size;
+    char* _memory;
+    T* _data;
+};
+}
+#endif // FELDRAND__PLANE_GRID_HPP
@@ -0,0 +1,131 @@
+/* Copyright (C) 2013  Marco Heisig
+
+This file is part of Feldrand.
+
+Feldrand is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more
+details.
+
+You should have received a copy of the GNU Affero General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FELDRAND__RING_QUEUE_HPP
+#define FELDRAND__RING_QUEUE_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <utility>
+
+namespace Feldrand {
+
+/* A bounded queue for any number of producer threads and a single consumer
+ * thread, without locks. Every slot carries a sequence number telling whose
+ * turn it is: a producer claims the slot at head by advancing head, fills it
+ * and hands it to the consumer by setting its sequence to position + 1. The
+ * consumer empties it and hands it back to the producers of the next round
+ * by setting it to position + Capacity. Values are moved in and out of the
+ * slots, which are allocated once with the queue. */
+template<typename T, size_t Capacity>
+class RingQueue {
+    static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0,
+                  "the capacity must be a power of two");
+public:
+    RingQueue() : head(0), tail(0) {
+        for(size_t i = 0; i < Capacity; ++i) {
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    RingQueue(const RingQueue&) = delete;
+    RingQueue& operator=(const RingQueue&) = delete;
+
+    /* false if the queue is full, value is left untouched then */
+    bool try_push(T& value) {
+        size_t pos = head.load(std::memory_order_relaxed);
+        Slot* slot;
+        for(;;) {
+            slot = &slots[pos & (Capacity - 1)];
+            const size_t sequence =
+                slot->sequence.load(std::memory_order_acquire);
+            const intptr_t turn = (intptr_t)sequence - (intptr_t)pos;
+            if(turn == 0) {
+                if(head.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed))
+                    break;
+            } else if(turn < 0) {
+                return false;
+            } else {
+                pos = head.load(std::memory_order_relaxed);
+            }
+        }
+        slot->value = std::move(value);
+        slot->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /* waits for the consumer while the queue is full */
+    void push(T value) {
+        while(!try_push(value)) {
+            std::this_thread::yield();
+        }
+    }
+
+    /* The next value, or nullptr if the queue is empty. Consumer only, the
+     * value stays in the queue. */
+    T* front() {
+        Slot& slot = slots[tail & (Capacity - 1)];
+        if(slot.sequence.load(std::memory_order_acquire) != tail + 1)
+            return nullptr;
+        return &slot.value;
+    }
+
+    /* false if the queue is empty. Consumer only. */
+    bool try_pop(T& value) {
+        Slot& slot = slots[tail & (Capacity - 1)];
+        if(slot.sequence.load(std::memory_order_acquire) != tail + 1)
+            return false;
+        value = std::move(slot.value);
+        // whatever the value holds on to is released now, not a round later
+        slot.value = T();
+        slot.sequence.store(tail + Capacity, std::memory_order_release);
+        ++tail;
+        return true;
+    }
+
+    /* The values pushed so far, counting those still being pushed, and the
+     * values popped so far. A consumer that stops popping once popped()
+     * reaches an earlier claimed() leaves the values pushed since then in
+     * the queue. */
+    size_t claimed() const {
+        return head.load(std::memory_order_relaxed);
+    }
+
+    size_t popped() const {
+        return tail;
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    Slot slots[Capacity];
+    /* head is shared by the producers, tail belongs to the consumer. The
+     * padding keeps them on separate cache lines. */
+    std::atomic<size_t> head;
+    char padding[64];
+    size_t tail;
+};
+
+}
+
+#endif // FELDRAND__RING_QUEUE_HPP
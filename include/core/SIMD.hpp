@@ -0,0 +1,348 @@
+/* Copyright (C) 2013  Marco Heisig
+
+This file is part of Feldrand.
+
+Feldrand is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more
+details.
+
+You should have received a copy of the GNU Affero General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FELDRAND__SIMD_HPP
+#define FELDRAND__SIMD_HPP
+
+/* A very thin wrapper around the vector registers of the target machine.
+ * The CPU kernels are written once against Pack<T> and compiled for
+ * AVX-512, AVX2 or plain scalar code, depending on what the compiler is
+ * allowed to emit (see the NATIVE build type). There are Packs of float and
+ * double. All loads and stores marked as aligned require addresses aligned
+ * to Pack<T>::width elements. */
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+namespace Feldrand {
+
+template<typename T>
+struct Pack;
+
+#if defined(__AVX512F__)
+
+template<>
+struct Pack<float> {
+    static const size_t width = 16;
+
+    struct Mask {
+        __mmask16 m;
+        Mask(__mmask16 m) : m(m) {}
+        inline Mask operator&(Mask o) const { return Mask(m & o.m); }
+        inline Mask operator|(Mask o) const { return Mask(m | o.m); }
+        inline Mask operator~() const { return Mask(~m); }
+        inline bool all() const { return m == 0xffff; }
+        inline bool any() const { return m != 0; }
+    };
+
+    __m512 v;
+    Pack() {}
+    Pack(__m512 v) : v(v) {}
+    Pack(float s) : v(_mm512_set1_ps(s)) {}
+
+    static inline Pack load(const float* p)  { return _mm512_load_ps(p); }
+    static inline Pack loadu(const float* p) { return _mm512_loadu_ps(p); }
+    inline void store(float* p) const  { _mm512_store_ps(p, v); }
+    inline void storeu(float* p) const { _mm512_storeu_ps(p, v); }
+    /* unaligned store of the lanes selected by m only */
+    inline void storeu(float* p, Mask m) const { _mm512_mask_storeu_ps(p, m.m, v); }
+
+    /* lanes whose 32 bit integer in p equals value */
+    static inline Mask match(const int32_t* p, int32_t value) {
+        __m512i i = _mm512_loadu_si512(p);
+        return _mm512_cmpeq_epi32_mask(i, _mm512_set1_epi32(value));
+    }
+    /* lanes whose byte in p equals value. The maskz form of the widening
+     * has no undefined passthrough, which GCC warns about. */
+    static inline Mask match(const uint8_t* p, uint8_t value) {
+        __m512i i = _mm512_maskz_cvtepu8_epi32((__mmask16)-1,
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+        return _mm512_cmpeq_epi32_mask(i, _mm512_set1_epi32(value));
+    }
+
+    /* lanes whose index first + lane lies in [lo, hi) */
+    static inline Mask range(ptrdiff_t first, ptrdiff_t lo, ptrdiff_t hi) {
+        __m512i i = _mm512_add_epi32(
+            _mm512_set1_epi32((int32_t)first),
+            _mm512_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7,
+                              8, 9, 10, 11, 12, 13, 14, 15));
+        return _mm512_cmpge_epi32_mask(i, _mm512_set1_epi32((int32_t)lo))
+            & _mm512_cmplt_epi32_mask(i, _mm512_set1_epi32((int32_t)hi));
+    }
+
+    friend inline Pack operator+(Pack a, Pack b) { return _mm512_add_ps(a.v, b.v); }
+    friend inline Pack operator-(Pack a, Pack b) { return _mm512_sub_ps(a.v, b.v); }
+    friend inline Pack operator*(Pack a, Pack b) { return _mm512_mul_ps(a.v, b.v); }
+    friend inline Pack operator/(Pack a, Pack b) { return _mm512_div_ps(a.v, b.v); }
+    friend inline Pack operator-(Pack a) { return _mm512_sub_ps(_mm512_setzero_ps(), a.v); }
+    friend inline Mask operator<(Pack a, Pack b) {
+        return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ);
+    }
+    friend inline Mask operator>(Pack a, Pack b) {
+        return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ);
+    }
+    /* m ? a : b, lane by lane */
+    friend inline Pack select(Mask m, Pack a, Pack b) {
+        return _mm512_mask_blend_ps(m.m, b.v, a.v);
+    }
+};
+
+template<>
+struct Pack<double> {
+    static const size_t width = 8;
+
+    struct Mask {
+        __mmask8 m;
+        Mask(__mmask8 m) : m(m) {}
+        inline Mask operator&(Mask o) const { return Mask(m & o.m); }
+        inline Mask operator|(Mask o) const { return Mask(m | o.m); }
+        inline Mask operator~() const { return Mask(~m); }
+        inline bool all() const { return m == 0xff; }
+        inline bool any() const { return m != 0; }
+    };
+
+    __m512d v;
+    Pack() {}
+    Pack(__m512d v) : v(v) {}
+    Pack(double s) : v(_mm512_set1_pd(s)) {}
+
+    static inline Pack load(const double* p)  { return _mm512_load_pd(p); }
+    static inline Pack loadu(const double* p) { return _mm512_loadu_pd(p); }
+    inline void store(double* p) const  { _mm512_store_pd(p, v); }
+    inline void storeu(double* p) const { _mm512_storeu_pd(p, v); }
+    inline void storeu(double* p, Mask m) const { _mm512_mask_storeu_pd(p, m.m, v); }
+
+    static inline Mask match(const int32_t* p, int32_t value) {
+        __m512i i = _mm512_cvtepi32_epi64(
+            _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p)));
+        return _mm512_cmpeq_epi64_mask(i, _mm512_set1_epi64(value));
+    }
+    static inline Mask match(const uint8_t* p, uint8_t value) {
+        __m512i i = _mm512_maskz_cvtepu8_epi64((__mmask8)-1,
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+        return _mm512_cmpeq_epi64_mask(i, _mm512_set1_epi64(value));
+    }
+
+    static inline Mask range(ptrdiff_t first, ptrdiff_t lo, ptrdiff_t hi) {
+        __m512i i = _mm512_add_epi64(_mm512_set1_epi64(first),
+                                     _mm512_setr_epi64(0, 1, 2, 3, 4, 5, 6, 7));
+        return _mm512_cmpge_epi64_mask(i, _mm512_set1_epi64(lo))
+            & _mm512_cmplt_epi64_mask(i, _mm512_set1_epi64(hi));
+    }
+
+    friend inline Pack operator+(Pack a, Pack b) { return _mm512_add_pd(a.v, b.v); }
+    friend inline Pack operator-(Pack a, Pack b) { return _mm512_sub_pd(a.v, b.v); }
+    friend inline Pack operator*(Pack a, Pack b) { return _mm512_mul_pd(a.v, b.v); }
+    friend inline Pack operator/(Pack a, Pack b) { return _mm512_div_pd(a.v, b.v); }
+    friend inline Pack operator-(Pack a) { return _mm512_sub_pd(_mm512_setzero_pd(), a.v); }
+    friend inline Mask operator<(Pack a, Pack b) {
+        return _mm512_cmp_pd_mask(a.v, b.v, _CMP_LT_OQ);
+    }
+    friend inline Mask operator>(Pack a, Pack b) {
+        return _mm512_cmp_pd_mask(a.v, b.v, _CMP_GT_OQ);
+    }
+    friend inline Pack select(Mask m, Pack a, Pack b) {
+        return _mm512_mask_blend_pd(m.m, b.v, a.v);
+    }
+};
+
+#elif defined(__AVX2__)
+
+template<>
+struct Pack<float> {
+    static const size_t width = 8;
+
+    struct Mask {
+        __m256 m;
+        Mask(__m256 m) : m(m) {}
+        inline Mask operator&(Mask o) const { return Mask(_mm256_and_ps(m, o.m)); }
+        inline Mask operator|(Mask o) const { return Mask(_mm256_or_ps(m, o.m)); }
+        inline Mask operator~() const {
+            return Mask(_mm256_xor_ps(m, _mm256_castsi256_ps(_mm256_set1_epi32(-1))));
+        }
+        inline bool all() const { return _mm256_movemask_ps(m) == 0xff; }
+        inline bool any() const { return _mm256_movemask_ps(m) != 0; }
+    };
+
+    __m256 v;
+    Pack() {}
+    Pack(__m256 v) : v(v) {}
+    Pack(float s) : v(_mm256_set1_ps(s)) {}
+
+    static inline Pack load(const float* p)  { return _mm256_load_ps(p); }
+    static inline Pack loadu(const float* p) { return _mm256_loadu_ps(p); }
+    inline void store(float* p) const  { _mm256_store_ps(p, v); }
+    inline void storeu(float* p) const { _mm256_storeu_ps(p, v); }
+    inline void storeu(float* p, Mask m) const {
+        _mm256_maskstore_ps(p, _mm256_castps_si256(m.m), v);
+    }
+
+    static inline Mask match(const int32_t* p, int32_t value) {
+        __m256i i = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+        return _mm256_castsi256_ps(_mm256_cmpeq_epi32(i, _mm256_set1_epi32(value)));
+    }
+    static inline Mask match(const uint8_t* p, uint8_t value) {
+        __m256i i = _mm256_cvtepu8_epi32(
+            _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p)));
+        return _mm256_castsi256_ps(_mm256_cmpeq_epi32(i, _mm256_set1_epi32(value)));
+    }
+
+    static inline Mask range(ptrdiff_t first, ptrdiff_t lo, ptrdiff_t hi) {
+        __m256i i = _mm256_add_epi32(_mm256_set1_epi32((int32_t)first),
+                                     _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+        __m256i below = _mm256_cmpgt_epi32(_mm256_set1_epi32((int32_t)lo), i);
+        __m256i inside = _mm256_cmpgt_epi32(_mm256_set1_epi32((int32_t)hi), i);
+        return _mm256_castsi256_ps(_mm256_andnot_si256(below, inside));
+    }
+
+    friend inline Pack operator+(Pack a, Pack b) { return _mm256_add_ps(a.v, b.v); }
+    friend inline Pack operator-(Pack a, Pack b) { return _mm256_sub_ps(a.v, b.v); }
+    friend inline Pack operator*(Pack a, Pack b) { return _mm256_mul_ps(a.v, b.v); }
+    friend inline Pack operator/(Pack a, Pack b) { return _mm256_div_ps(a.v, b.v); }
+    friend inline Pack operator-(Pack a) { return _mm256_sub_ps(_mm256_setzero_ps(), a.v); }
+    friend inline Mask operator<(Pack a, Pack b) {
+        return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ);
+    }
+    friend inline Mask operator>(Pack a, Pack b) {
+        return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ);
+    }
+    friend inline Pack select(Mask m, Pack a, Pack b) {
+        return _mm256_blendv_ps(b.v, a.v, m.m);
+    }
+};
+
+template<>
+struct Pack<double> {
+    static const size_t width = 4;
+
+    struct Mask {
+        __m256d m;
+        Mask(__m256d m) : m(m) {}
+        inline Mask operator&(Mask o) const { return Mask(_mm256_and_pd(m, o.m)); }
+        inline Mask operator|(Mask o) const { return Mask(_mm256_or_pd(m, o.m)); }
+        inline Mask operator~() const {
+            return Mask(_mm256_xor_pd(m, _mm256_castsi256_pd(_mm256_set1_epi64x(-1))));
+        }
+        inline bool all() const { return _mm256_movemask_pd(m) == 0xf; }
+        inline bool any() const { return _mm256_movemask_pd(m) != 0; }
+    };
+
+    __m256d v;
+    Pack() {}
+    Pack(__m256d v) : v(v) {}
+    Pack(double s) : v(_mm256_set1_pd(s)) {}
+
+    static inline Pack load(const double* p)  { return _mm256_load_pd(p); }
+    static inline Pack loadu(const double* p) { return _mm256_loadu_pd(p); }
+    inline void store(double* p) const  { _mm256_store_pd(p, v); }
+    inline void storeu(double* p) const { _mm256_storeu_pd(p, v); }
+    inline void storeu(double* p, Mask m) const {
+        _mm256_maskstore_pd(p, _mm256_castpd_si256(m.m), v);
+    }
+
+    static inline Mask match(const int32_t* p, int32_t value) {
+        __m256i i = _mm256_cvtepi32_epi64(
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+        return _mm256_castsi256_pd(_mm256_cmpeq_epi64(i, _mm256_set1_epi64x(value)));
+    }
+    static inline Mask match(const uint8_t* p, uint8_t value) {
+        int32_t bytes;
+        std::memcpy(&bytes, p, sizeof(bytes));
+        __m256i i = _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(bytes));
+        return _mm256_castsi256_pd(_mm256_cmpeq_epi64(i, _mm256_set1_epi64x(value)));
+    }
+
+    static inline Mask range(ptrdiff_t first, ptrdiff_t lo, ptrdiff_t hi) {
+        __m256i i = _mm256_add_epi64(_mm256_set1_epi64x(first),
+                                     _mm256_setr_epi64x(0, 1, 2, 3));
+        __m256i below = _mm256_cmpgt_epi64(_mm256_set1_epi64x(lo), i);
+        __m256i inside = _mm256_cmpgt_epi64(_mm256_set1_epi64x(hi), i);
+        return _mm256_castsi256_pd(_mm256_andnot_si256(below, inside));
+    }
+
+    friend inline Pack operator+(Pack a, Pack b) { return _mm256_add_pd(a.v, b.v); }
+    friend inline Pack operator-(Pack a, Pack b) { return _mm256_sub_pd(a.v, b.v); }
+    friend inline Pack operator*(Pack a, Pack b) { return _mm256_mul_pd(a.v, b.v); }
+    friend inline Pack operator/(Pack a, Pack b) { return _mm256_div_pd(a.v, b.v); }
+    friend inline Pack operator-(Pack a) { return _mm256_sub_pd(_mm256_setzero_pd(), a.v); }
+    friend inline Mask operator<(Pack a, Pack b) {
+        return _mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ);
+    }
+    friend inline Mask operator>(Pack a, Pack b) {
+        return _mm256_cmp_pd(a.v, b.v, _CMP_GT_OQ);
+    }
+    friend inline Pack select(Mask m, Pack a, Pack b) {
+        return _mm256_blendv_pd(b.v, a.v, m.m);
+    }
+};
+
+#else
+
+/* scalar fallback for every T, the compiler is free to do whatever it can */
+template<typename T>
+struct Pack {
+    static const size_t width = 1;
+
+    struct Mask {
+        bool m;
+        Mask(bool m) : m(m) {}
+        inline Mask operator&(Mask o) const { return Mask(m && o.m); }
+        inline Mask operator|(Mask o) const { return Mask(m || o.m); }
+        inline Mask operator~() const { return Mask(!m); }
+        inline bool all() const { return m; }
+        inline bool any() const { return m; }
+    };
+
+    T v;
+    Pack() {}
+    Pack(T s) : v(s) {}
+
+    static inline Pack load(const T* p)  { return *p; }
+    static inline Pack loadu(const T* p) { return *p; }
+    inline void store(T* p) const  { *p = v; }
+    inline void storeu(T* p) const { *p = v; }
+    inline void storeu(T* p, Mask m) const { if(m.m) *p = v; }
+
+    static inline Mask match(const int32_t* p, int32_t value) {
+        return *p == value;
+    }
+    static inline Mask match(const uint8_t* p, uint8_t value) {
+        return *p == value;
+    }
+
+    static inline Mask range(ptrdiff_t first, ptrdiff_t lo, ptrdiff_t hi) {
+        return first >= lo && first < hi;
+    }
+
+    friend inline Pack operator+(Pack a, Pack b) { return a.v + b.v; }
+    friend inline Pack operator-(Pack a, Pack b) { return a.v - b.v; }
+    friend inline Pack operator*(Pack a, Pack b) { return a.v * b.v; }
+    friend inline Pack operator/(Pack a, Pack b) { return a.v / b.v; }
+    friend inline Pack operator-(Pack a) { return -a.v; }
+    friend inline Mask operator<(Pack a, Pack b) { return a.v < b.v; }
+    friend inline Mask operator>(Pack a, Pack b) { return a.v > b.v; }
+    friend inline Pack select(Mask m, Pack a, Pack b) { return m.m ? a : b; }
+};
+
+#endif
+
+}
+#endif // FELDRAND__SIMD_HPP
@@ -42,6 +42,7 @@ with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <stdexcept>
 #include <memory>
 #include <string>
+#include <vector>
 #include "core/Grid.hpp"
 #include "core/Vec2D.hpp"
 
@@ -62,6 +63,25 @@ enum struct mask_t {
     IGNORE
 };
 
+/* How a backend streams its populations. TWO_GRID reads from one copy of the
+ * populations and writes to another, IN_PLACE gets along with a single copy
+ * (AA-pattern) at half the memory and less memory traffic. Both produce the
+ * same results. */
+enum struct streaming_t {
+    TWO_GRID,
+    IN_PLACE
+};
+
+/* Where the worker threads of CPU backends run. NONE leaves them to the
+ * operating system, COMPACT pins thread i to the i-th available CPU and
+ * SCATTER splits the threads evenly among the sockets of the machine, and
+ * within a socket puts them on distinct cores as long as there are enough. */
+enum struct affinity_t {
+    NONE,
+    COMPACT,
+    SCATTER
+};
+
 class Simulation {
 public:
     /* Each Feldrand::Simulation is performed on a rectangular domain.  The
@@ -76,19 +96,38 @@ public:
      * g = grid
      * t = total_points
      * The simulation is in paused state upon construction. Call run() to
-     * begin and pause() to pause again. */
+     * begin and pause() to pause again.
+     *
+     * backend is one of the names returned by backends(), "default" for
+     * the first of them that initializes, or "auto" to briefly run every
+     * available backend on the requested grid and take the fastest, which
+     * costs about 0.2 seconds per backend. A named backend that fails to
+     * initialize throws a std::runtime_error. */
     static Simulation create_dwdhgt(double domain_width, double domain_height,
-                                    size_t total_points);
+                                    size_t total_points,
+                                    const std::string& backend = "default");
     static Simulation create_dwdhgw(double domain_width, double domain_height,
-                                    size_t grid_width);
+                                    size_t grid_width,
+                                    const std::string& backend = "default");
     static Simulation create_dwdhgh(double domain_width, double domain_height,
-                                    size_t grid_heigth);
-    static Simulation create_from_image( std::string filename);
-  
+                                    size_t grid_heigth,
+                                    const std::string& backend = "default");
+    static Simulation create_from_image(std::string filename,
+                                        const std::string& backend = "default");
+
+    /* The backends usable on this machine, fastest first as far as known
+     * without measuring: "BGK_OCL:all", splitting the grid across all
+     * OpenCL devices if there are several, "BGK_OCL:<n>" for the n-th
+     * OpenCL device, "BGK_OCL+CPU:<n>" sharing the grid between it and
+     * the host's cores, then the CPU solvers "MRT_LBM", "TRT_LBM" and
+     * "BGK_LBM". */
+    static std::vector<std::string> backends();
+
 protected:
-    Simulation(std::string filename);
+    Simulation(std::string filename, const std::string& backend);
     Simulation(double domain_width, double domain_height,
-               size_t grid_width, size_t grid_height);
+               size_t grid_width, size_t grid_height,
+               const std::string& backend);
 public:
     Simulation();
     Simulation(Simulation&& other);
@@ -102,8 +141,18 @@ public:
         pause,
         run,
         clear,
-        draw,    // requires data = draw_data&
-        steps    // requires data = size_t
+        draw,     // requires data = draw_data&
+        steps,    // requires data = size_t
+        streaming, // requires data = streaming_t
+        blocking,  // requires data = blocking_data
+        threads,   // requires data = threads_data
+        publishing, // requires data = size_t, see frame_data
+        /* physical seconds simulated per second, 0 (the default) runs as
+         * fast as the machine allows, see realtime_factor */
+        speed,     // requires data = double
+        /* the longest a round of the work thread takes, and so about the
+         * longest a request waits, 0.01 seconds by default */
+        latency    // requires data = double, in seconds
     };
 
     struct draw_data {
@@ -112,6 +161,62 @@ public:
         cell_t type;
     };
 
+    /* Cache blocking of backends that support it: temporal_depth timesteps
+     * are performed in one sweep over the grid, block_height rows at a time.
+     * A temporal_depth of 1 disables the blocking. */
+    struct blocking_data {
+        size_t block_height;
+        size_t temporal_depth;
+    };
+
+    /* Number of worker threads of backends that use them, 0 means one per
+     * available CPU. The grids are redistributed over the NUMA nodes of the
+     * new threads. */
+    struct threads_data {
+        size_t count;
+        affinity_t affinity;
+    };
+
+    /* The fields of the simulation after timestep timestep_id. Once a
+     * frame has been asked for, the simulation publishes a new one as soon
+     * as n timesteps have passed since the last, n as set by the publishing
+     * action and 1 by default. Frames are taken between the rounds of the
+     * work thread, whose size varies, so they may lie more than n timesteps
+     * apart. get() returns the latest one without waiting for the
+     * simulation, except for the very first. */
+    struct frame_data {
+        std::shared_ptr<const Grid<Vec2D<float>>> velocity;
+        std::shared_ptr<const Grid<float>> density;
+        size_t timestep_id;
+    };
+
+    /* Rolling statistics of the simulation's work thread, averaged over
+     * its last rounds with exponentially decreasing weights. get() returns
+     * them without waiting for the simulation. */
+    struct perf_data {
+        /* million lattice cell updates per second */
+        double mlups;
+        /* Seconds per round of the work thread, and the part of it spent
+         * in each phase: the solver's iterations, in which collision and
+         * streaming are a single pass, reading fields back for frames and
+         * get(), applying draws and clears, and handling the other
+         * requests. Solvers that run asynchronously finish their iterations
+         * while the fields are read back. */
+        double round_seconds;
+        double iterate_seconds;
+        double readback_seconds;
+        double draw_seconds;
+        double request_seconds;
+        /* requests per round, and the seconds they wait in the queue on
+         * average and at most during the round */
+        double queue_depth;
+        double queue_latency;
+        double max_queue_latency;
+        /* seconds since the latest frame was taken */
+        double snapshot_age;
+        size_t rounds;
+    };
+
     /* Make the simulation to perform an action. */
     template<typename T>
     void action(Action what, T data);
@@ -125,26 +230,46 @@ public:
         gridWidth,     // -> size_t
         gridHeight,    // -> size_t
         timestep_id,   // -> size_t
+        steps_per_second, // -> double
+        realtime_factor, // -> double, the most speed the last round allows
         velocity_grid, // -> Grid<Vec2D<float>>*
+                       //    or std::shared_ptr<const Grid<Vec2D<float>>>
         density_grid,  // -> Grid<float>*
-        type_grid      // -> Grid<cell_t>*
+                       //    or std::shared_ptr<const Grid<float>>
+        type_grid,     // -> Grid<cell_t>*
+        vorticity_grid, // -> Grid<float>*
+                        //    or std::shared_ptr<const Grid<float>>
+        frame,         // -> frame_data
+        perf_stats     // -> perf_data
     };
 
-    /* Request some data from the Simulation. Calls to this function may block
-     * for at most one complete simulation timestep. You might use std::async
-     * to avoid this. */
+    /* Request some data from the Simulation. The grids are read between
+     * two rounds of the work thread, so asking for one may block for up to
+     * a round, about latency seconds; you might use std::async to avoid
+     * this. frame, perf_stats and the scalars return what was published
+     * last without blocking. Grids returned as pointers belong to the
+     * caller, grids returned as shared_ptr are recycled by the Simulation
+     * once released, which spares an allocation per call for readers that
+     * ask often. */
     template<typename T>
     auto get(Data what) -> T;
 
     /* The Simulations methods do not guarantee that successive requests apply
      * to the same timestep.  If this behaviour is desired, put all those
-     * calls in a beginMultiple(); ... endMultiple(); block. */
+     * calls in a beginMultiple(); ... endMultiple(); block. Its first get()
+     * of a grid or the timestep_id computes all the grids at once, and
+     * the block's later ones return them without waiting. Blocks of
+     * different threads take turns. */
     void beginMultiple();
     void endMultiple();
 
+    /* the name of the backend in use, as in backends() */
+    const std::string& backend() const;
+
     class SimulationImplementation;
 private:
     SimulationImplementation* impl;
+    std::string backend_name;
     friend std::ostream& operator<<(std::ostream &dest,
                                     Simulation& sim);
     friend std::istream& operator>>(std::istream &src,
@@ -163,6 +288,14 @@ template<> void
 Simulation::action<size_t>(Action what, size_t data);
 template<> void
 Simulation::action<Simulation::draw_data&>(Action what, Simulation::draw_data& data);
+template<> void
+Simulation::action<double>(Action what, double data);
+template<> void
+Simulation::action<streaming_t>(Action what, streaming_t data);
+template<> void
+Simulation::action<Simulation::blocking_data>(Action what, Simulation::blocking_data data);
+template<> void
+Simulation::action<Simulation::threads_data>(Action what, Simulation::threads_data data);
 
 template<> auto
 Simulation::get<double>(Data what) -> double;
@@ -173,7 +306,17 @@ Simulation::get<Grid<Vec2D<float>>*>(Data what) -> Grid<Vec2D<float>>*;
 template<> auto
 Simulation::get<Grid<float>*>(Data what) -> Grid<float>*;
 template<> auto
+Simulation::get<std::shared_ptr<const Grid<Vec2D<float>>>>(Data what)
+    -> std::shared_ptr<const Grid<Vec2D<float>>>;
+template<> auto
+Simulation::get<std::shared_ptr<const Grid<float>>>(Data what)
+    -> std::shared_ptr<const Grid<float>>;
+template<> auto
 Simulation::get<Grid<cell_t>*>(Data what) -> Grid<cell_t>*;
+template<> auto
+Simulation::get<Simulation::frame_data>(Data what) -> Simulation::frame_data;
+template<> auto
+Simulation::get<Simulation::perf_data>(Data what) -> Simulation::perf_data;
 
 /* If the template type of action() or get() is none of the above
  * ones, static_assert will inform you at compile time. */
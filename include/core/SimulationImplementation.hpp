@@ -19,19 +19,24 @@ with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #define FELDRAND__SIMULATION_IMPLEMENTATION_HPP
 
 #include <mutex>
-#include <queue>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <chrono>
 #include <condition_variable>
 #include <functional>
 #include <string>
 #include <iterator>
 #include <memory>
 #include <istream>
+#include <vector>
 #include "Simulation.hpp"
 #include "core/Grid.hpp"
+#include "core/RingQueue.hpp"
+#include "core/SnapshotPool.hpp"
+#include "core/TripleBuffer.hpp"
 #include "core/Vec2D.hpp"
 
-namespace std { class thread; }
-
 namespace Feldrand {
 
 	struct Cell {
@@ -68,10 +73,89 @@ namespace Feldrand {
 		void beginMultiple();
 		void endMultiple();
 
+		/* Start and stop the work thread. start() must be called once the
+		 * object is fully constructed, because the thread calls the virtual
+		 * solver interface, and stop() before the object is destroyed.
+		 * start() returns once the thread has initialized the solver, and
+		 * throws what init() threw if that failed, with the thread ended. */
+		void start();
+		void stop();
+
 	private:
-		void loop();
-		void advance();
-		void handle_requests();
+		/* A request for the work thread, as put in the todo_queue by
+		 * action() and get(). Only the members of its kind are set. */
+		struct Command {
+			enum class Kind {
+				clear, draw, steps, streaming, blocking, threads,
+				publishing, speed, latency, frame, fields
+			};
+			Kind kind;
+			/* draw */
+			int x;
+			int y;
+			std::shared_ptr<const Grid<mask_t>> mask_ptr;
+			cell_t type;
+			/* steps or the publishing interval, and block_height and
+			 * temporal_depth or count of blocking and threads */
+			size_t first;
+			size_t second;
+			streaming_t mode;
+			affinity_t affinity;
+			/* speed or latency */
+			double value;
+			/* when it was queued */
+			std::chrono::high_resolution_clock::time_point queued;
+			/* the Fields to fill, if the kind has them, and the result the
+			 * caller of get() waits for */
+			void* grid;
+			std::promise<void*>* result;
+		};
+
+		/* The grids a fields request fills, those that are not nullptr, and
+		 * the timestep they are taken at. */
+		struct Fields {
+			Grid<Vec2D<float>>* velocity;
+			Grid<float>* density;
+			Grid<cell_t>* types;
+			size_t timestep_id;
+		};
+
+		/* the fields of a beginMultiple() block, all of the same timestep */
+		struct Snapshot {
+			std::shared_ptr<const Grid<Vec2D<float>>> velocity;
+			std::shared_ptr<const Grid<float>> density;
+			std::shared_ptr<const Grid<cell_t>> types;
+			std::shared_ptr<const Grid<float>> vorticity;
+			size_t timestep_id;
+		};
+
+		/* the statistics published by the work thread, see account() */
+		struct Stats {
+			Simulation::perf_data perf;
+			std::chrono::high_resolution_clock::time_point frame_time;
+		};
+
+		void loop(std::promise<void>* initialized);
+		void advance(size_t done);
+		bool handle_requests();
+		void publish(bool now = false);
+		void pace(size_t done);
+		void account(double round_seconds, size_t done);
+		void dequeued(const Command& command);
+		void read_fields(Grid<Vec2D<float>>* velocity,
+						 Grid<float>* density,
+						 Grid<cell_t>* types);
+		void restart_schedule();
+		auto seconds_per_step() -> double;
+		void execute(Command& command);
+		void enqueue(Command& command);
+		void* request(Command::Kind kind, void* grid);
+		void fetch(Fields& fields);
+		bool in_multiple();
+		auto multiple_snapshot() -> const Snapshot&;
+		auto vorticity(const Grid<Vec2D<float>>& velocity)
+			-> std::shared_ptr<const Grid<float>>;
+		void coalesce_draws(Command& draw, size_t end);
 		void do_pause();
 		void do_run();
 		void do_steps(size_t steps);
@@ -81,20 +165,40 @@ namespace Feldrand {
 		auto get_gridWidth()     -> size_t;
 		auto get_gridHeight()    -> size_t;
 		auto get_timestep_id()   -> size_t;
+		auto get_steps_per_second() -> double;
+		auto get_realtime_factor() -> double;
 
 	protected:
 		/* interface for iterative fluid solvers */
 		virtual void init() = 0;
 		virtual void one_iteration() = 0;
+		/* the work thread's way to call one_iteration() steps times, solvers
+		 * may override it to fuse several iterations */
+		virtual void iterate(size_t steps);
+		/* the kinematic viscosity in cells squared per timestep, which
+		 * fixes the physical time of a timestep */
+		virtual auto lattice_viscosity() -> double = 0;
+		/* the timesteps one_iteration() performs, 1 by default */
+		virtual auto timesteps_per_iteration() -> size_t;
 		virtual void do_clear() = 0;
 		virtual void do_draw(int x, int y,
 							 std::shared_ptr<const Grid<mask_t>> mask_ptr,
 							 cell_t type) = 0;
-		virtual auto get_velocity_grid() -> Grid<Vec2D<float>>* = 0;
-		virtual auto get_density_grid()  -> Grid<float>* = 0;
-		virtual auto get_type_grid()     -> Grid<cell_t>* = 0;
+		/* write the fields that are not nullptr into grids of the
+		 * simulation's size, reading each cell's populations once for all
+		 * of them */
+		virtual void get_fields(Grid<Vec2D<float>>* velocity,
+								Grid<float>* density,
+								Grid<cell_t>* types) = 0;
 		virtual void write_data(std::ostream& dest) = 0;
 		virtual void read_data(std::istream& src) = 0;
+		/* switch between two grid and in place streaming, the results must
+		 * not depend on the mode */
+		virtual void do_streaming(streaming_t mode) = 0;
+		/* optional, ignored by default */
+		virtual void do_blocking(size_t block_height, size_t temporal_depth);
+		/* optional, ignored by default. Called from the work thread. */
+		virtual void do_threads(size_t count, affinity_t affinity);
 
 	protected:
 		double width;
@@ -105,15 +209,57 @@ namespace Feldrand {
 		double density;
 		/* 1.0 is realtime, 2.0 is twice as fast, 0.5 is half as fast*/
 		double speed;
+		/* the timesteps simulated so far */
 		size_t ts_id;
+		/* timesteps per second over the last round of the work thread,
+		 * and the speed they amount to. Written by the work thread, read by
+		 * get() on any other. */
+		std::atomic<double> steps_per_second;
+		std::atomic<double> realtime_factor;
+		/* Owned by the work thread, see pace(). Batches are planned in
+		 * iterations, from the iterations per second of the last round.
+		 * The schedule is the simulated time since schedule_start, at the
+		 * speed in use then. */
+		double iterations_per_second;
+		size_t batch;
+		double latency;
+		double simulated;
+		std::chrono::time_point<std::chrono::high_resolution_clock>
+			schedule_start;
 
 		std::thread* work_thread;
 
 		std::mutex rw_mutex;
 		std::chrono::time_point<std::chrono::high_resolution_clock> timestamp;
 
-		std::mutex todo_queue_mutex;
-		std::queue<std::function<void()>> todo_queue;
+		/* any thread pushes, the work thread alone pops */
+		RingQueue<Command, 1024> todo_queue;
+		/* the draws merged by coalesce_draws(), kept to reuse the memory */
+		std::vector<Command> strokes;
+		SnapshotPool<Vec2D<float>> velocity_snapshots;
+		SnapshotPool<float> density_snapshots;
+		SnapshotPool<cell_t> type_snapshots;
+
+		/* held by the thread inside a beginMultiple() block, which alone
+		 * touches multiple */
+		std::mutex multiple_mutex;
+		std::atomic<std::thread::id> multiple_owner;
+		Snapshot multiple;
+
+		/* written by the work thread alone, see publish(). frames_wanted
+		 * is set by the first reader. */
+		TripleBuffer<Simulation::frame_data> frames;
+		size_t publish_interval;
+		size_t unpublished_steps;
+		bool unpublished_changes;
+		std::atomic<bool> frames_wanted;
+
+		/* written by the work thread alone: the sums of the current round,
+		 * their rolling averages, and when the latest frame was taken */
+		Simulation::perf_data round_totals;
+		Simulation::perf_data perf;
+		std::chrono::high_resolution_clock::time_point frame_time;
+		TripleBuffer<Stats> stats;
 
 		/* tell the simulation to pause or run */
 		bool pause;
@@ -136,6 +282,18 @@ namespace Feldrand {
 	template<>
 	void Simulation::SimulationImplementation::
 	action<size_t>(Action what, size_t data);
+	template<>
+	void Simulation::SimulationImplementation::
+	action<double>(Action what, double data);
+	template<>
+	void Simulation::SimulationImplementation::
+	action<streaming_t>(Action what, streaming_t data);
+	template<>
+	void Simulation::SimulationImplementation::
+	action<Simulation::blocking_data>(Action what, Simulation::blocking_data data);
+	template<>
+	void Simulation::SimulationImplementation::
+	action<Simulation::threads_data>(Action what, Simulation::threads_data data);
 
 	template<typename T>
 	auto Simulation::SimulationImplementation::
@@ -157,7 +315,21 @@ namespace Feldrand {
 	get<Grid<float>*>(Data what) -> Grid<float>*;
 	template<>
 	auto Simulation::SimulationImplementation::
+	get<std::shared_ptr<const Grid<Vec2D<float>>>>(Data what)
+		-> std::shared_ptr<const Grid<Vec2D<float>>>;
+	template<>
+	auto Simulation::SimulationImplementation::
+	get<std::shared_ptr<const Grid<float>>>(Data what)
+		-> std::shared_ptr<const Grid<float>>;
+	template<>
+	auto Simulation::SimulationImplementation::
 	get<Grid<cell_t>*>(Data what) -> Grid<cell_t>*;
+	template<>
+	auto Simulation::SimulationImplementation::
+	get<Simulation::frame_data>(Data what) -> Simulation::frame_data;
+	template<>
+	auto Simulation::SimulationImplementation::
+	get<Simulation::perf_data>(Data what) -> Simulation::perf_data;
 }
 
 #endif // FELDRAND__SIMULATION_IMPLEMENTATION_HPP
@@ -16,6 +16,7 @@ You should have received a copy of the GNU Affero General Public License along
 with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <memory>
+#include <string>
 #include "core/Simulation.hpp"
 #include "core/Grid.hpp"
 
@@ -23,4 +24,8 @@ namespace Feldrand {
 
 auto createCircleMask(int diameter) -> std::shared_ptr<const Grid<mask_t>>;
 
+/* A mask of the size of a greyscale PNG image, in which all pixels that are
+ * not black are set to MODIFY. Throws if the image cannot be read. */
+auto createImageMask(std::string filename) -> std::shared_ptr<const Grid<mask_t>>;
+
 }
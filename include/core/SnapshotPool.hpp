@@ -0,0 +1,95 @@
+/* Copyright (C) 2013  Marco Heisig
+
+This file is part of Feldrand.
+
+Feldrand is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more
+details.
+
+You should have received a copy of the GNU Affero General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FELDRAND__SNAPSHOT_POOL_HPP
+#define FELDRAND__SNAPSHOT_POOL_HPP
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "core/Grid.hpp"
+
+namespace Feldrand {
+
+/* Recycles the grids of field snapshots. acquire() hands out a grid of the
+ * requested size together with the handle that returns it: once the last
+ * copy of the handle is gone, the grid goes back to the pool instead of
+ * being freed. Three spare grids are kept, one being shown, one being
+ * filled and one in between, which is all a reader taking one snapshot per
+ * frame ever needs. Grids beyond that, or of a size no longer requested,
+ * are freed. The handles may outlive the pool and be released from any
+ * thread. */
+template<typename T>
+class SnapshotPool {
+public:
+    static const size_t spares = 3;
+
+    SnapshotPool() : state(std::make_shared<State>()) {}
+
+    SnapshotPool(const SnapshotPool&) = delete;
+    SnapshotPool& operator=(const SnapshotPool&) = delete;
+
+    /* The grid's contents are those of some earlier snapshot, or undefined
+     * for a new one. It may be written until the handle is passed on. */
+    std::shared_ptr<const Grid<T>> acquire(size_t x, size_t y) {
+        Grid<T>* grid = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(state->mutex);
+            while(!state->free.empty() && !grid) {
+                grid = state->free.back();
+                state->free.pop_back();
+                if(grid->x() != x || grid->y() != y) {
+                    delete grid;
+                    grid = nullptr;
+                }
+            }
+        }
+        if(!grid) grid = new Grid<T>(x, y);
+        std::shared_ptr<State> owner = state;
+        return std::shared_ptr<const Grid<T>>(grid, [owner](const Grid<T>* g) {
+                owner->recycle(const_cast<Grid<T>*>(g));
+            });
+    }
+
+private:
+    struct State {
+        std::mutex mutex;
+        std::vector<Grid<T>*> free;
+
+        void recycle(Grid<T>* grid) {
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                if(free.size() < spares) {
+                    free.push_back(grid);
+                    return;
+                }
+            }
+            delete grid;
+        }
+
+        ~State() {
+            for(Grid<T>* grid : free) delete grid;
+        }
+    };
+
+    std::shared_ptr<State> state;
+};
+
+}
+
+#endif // FELDRAND__SNAPSHOT_POOL_HPP
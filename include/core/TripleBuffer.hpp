@@ -0,0 +1,85 @@
+/* Copyright (C) 2013  Marco Heisig
+
+This file is part of Feldrand.
+
+Feldrand is free software: you can redistribute it and/or modify it under the
+terms of the GNU Affero General Public License as published by the Free
+Software Foundation, either version 3 of the License, or (at your option) any
+later version.
+
+This program is distributed in the hope that it will be useful, but WITHOUT
+ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS
+FOR A PARTICULAR PURPOSE.  See the GNU Affero General Public License for more
+details.
+
+You should have received a copy of the GNU Affero General Public License along
+with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef FELDRAND__TRIPLE_BUFFER_HPP
+#define FELDRAND__TRIPLE_BUFFER_HPP
+
+#include <atomic>
+#include <thread>
+
+namespace Feldrand {
+
+/* Hands the latest of a series of values from one writer thread to readers,
+ * without the writer ever waiting. The writer fills the back slot and swaps
+ * it with the middle one, the readers swap the middle slot with the front
+ * one whenever the middle one is newer, and copy the front one. Both swaps
+ * are a single atomic exchange of the middle slot's index, which carries
+ * the fresh flag along. Readers take turns among themselves, so several of
+ * them may share the buffer. */
+template<typename T>
+class TripleBuffer {
+public:
+    TripleBuffer() : middle(1), back(0), front(2) {
+        reading.clear();
+    }
+
+    TripleBuffer(const TripleBuffer&) = delete;
+    TripleBuffer& operator=(const TripleBuffer&) = delete;
+
+    /* Writer only. The slot to fill next, holding the value published
+     * three publications ago, or nothing. */
+    T& next() {
+        return slots[back];
+    }
+
+    /* Writer only. Makes the value in next() the latest. */
+    void publish() {
+        back = middle.exchange(back | fresh, std::memory_order_acq_rel)
+            & index;
+    }
+
+    /* A copy of the latest value, or of a default constructed T if none
+     * has been published yet. */
+    T latest() {
+        while(reading.test_and_set(std::memory_order_acquire)) {
+            std::this_thread::yield();
+        }
+        if(middle.load(std::memory_order_relaxed) & fresh) {
+            front = middle.exchange(front, std::memory_order_acq_rel)
+                & index;
+        }
+        T value = slots[front];
+        reading.clear(std::memory_order_release);
+        return value;
+    }
+
+private:
+    static const unsigned index = 3;
+    static const unsigned fresh = 4;
+
+    T slots[3];
+    std::atomic<unsigned> middle;
+    /* owned by the writer */
+    unsigned back;
+    /* owned by the reader holding reading */
+    unsigned front;
+    std::atomic_flag reading;
+};
+
+}
+
+#endif // FELDRAND__TRIPLE_BUFFER_HPP
@@ -21,7 +21,6 @@ with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <GL/glew.h> //Has to be included before QGLWidget
 #include <memory>
 #include <mutex>
-#include <chrono>
 #include <QGLWidget>
 #include "Simulation.hpp"
 #include "DrawPlain.hpp"
@@ -94,7 +93,6 @@ protected:
     DrawArrows draw_arrows;
     DrawLIC draw_lic;
     DrawingRoutine* drawing_routine;
-	std::chrono::time_point<std::chrono::high_resolution_clock> timestamp;
 };
 }
 #endif // FELDRAND__OPENGL_WIDGET_HPP
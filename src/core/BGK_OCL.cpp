@@ -16,8 +16,18 @@ You should have received a copy of the GNU Affero General Public License along
 with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include "core/BGK_OCL.hpp"
+#include "core/KernelSources.hpp"
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <sys/time.h>
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
 #include "core/lodepng.h"
 
 using namespace std;
@@ -38,19 +48,167 @@ const float source[] = {1.4f / 36.0f, 1.4f / 9.0f, 1.4f / 36.0f,
 const float drain[] = {0.6f / 36.0f, 0.6f / 9.0f, 0.6f / 36.0f,
                        0.6f / 9.0f,  5.0f / 9.0f, 0.6f / 9.0f,
                        0.6f / 36.0f, 0.6f / 9.0f, 0.6f / 36.0f};
+
+// local sizes tried by tune(), the first one is the untuned default
+const size_t candidates[][2] = {{16, 16}, {32, 8},  {64, 4}, {8, 8},
+                                {32, 4},  {8, 32},  {64, 1}, {128, 1},
+                                {256, 1}, {32, 16}, {64, 8}};
+
+// one line per tuned grid: width height local_x local_y slabs devices, where
+// slabs is hybrid: or slabs: followed by the first-last rows of each slab
+const char* const tuning_cache = "tuning.txt";
+
+const int tuning_steps = 10;
+
+// rows of the device arrays start at multiples of 32 floats (128 bytes)
+const int row_alignment = 32;
+
+// relaxation rate of the BGK collision
+const float omega = 1.15f;
+
+// rows a slab holds beyond each boundary with another slab. Two let it run
+// the even and the odd in place step, or two steps with two grids, before
+// its halo has to be exchanged.
+const size_t halo_rows = 2;
+
+// $XDG_CACHE_HOME/feldrand or ~/.cache/feldrand, created if needed. Empty if
+// neither variable is set, which disables all caching.
+std::string cache_directory() {
+  std::string base;
+  if (const char* xdg = getenv("XDG_CACHE_HOME")) {
+    base = xdg;
+  } else if (const char* home = getenv("HOME")) {
+    base = std::string(home) + "/.cache";
+  } else {
+    return "";
+  }
+  mkdir(base.c_str(), 0755);
+  const std::string dir = base + "/feldrand";
+  mkdir(dir.c_str(), 0755);
+  return dir;
+}
+
+// 64 bit FNV-1a, stable across compilers and runs, unlike std::hash
+uint64_t fnv1a(const std::string& data) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : data) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// OpenCL errors are thrown rather than fatal, so that Simulation can fall
+// back on another backend when one occurs during the initialization.
+void check(cl_int error, const char* what) {
+  if (error != CL_SUCCESS) {
+    throw std::runtime_error(std::string(what) + " failed with OpenCL error " +
+                             std::to_string(error));
+  }
+}
+
+void set_arg(cl_kernel kernel, cl_uint& n, size_t size, const void* value) {
+  check(clSetKernelArg(kernel, n++, size, value), "clSetKernelArg");
+}
+
+void release_events(std::vector<cl_event>& events) {
+  for (cl_event event : events) {
+    clReleaseEvent(event);
+  }
+  events.clear();
+}
+
+// The host's share of a hybrid simulation runs simulationStep.cl itself,
+// compiled as C++, so that both sides simulate the same model, on arrays in
+// the same layout. Each host thread is a work item of a single work group,
+// whose tile is the row it computes and whose local id is the column.
+enum direction { NW = 0, N = 1, NE = 2, W = 3, C = 4, E = 5, SW = 6, S = 7,
+                 SE = 8 };
+
+namespace host {
+thread_local int work_item;
+
+#define kernel
+#define global
+#define restrict __restrict__
+#define get_global_id(dim) ((dim) == 0 ? work_item : 0)
+#define get_local_id(dim) ((dim) == 0 ? work_item : 0)
+#define get_group_id(dim) 0
+#define OMEGA omega
+#include "simulationStep.cl"
+#undef kernel
+#undef global
+#undef restrict
+#undef get_global_id
+#undef get_local_id
+#undef get_group_id
+}
+
+// computeLinks for the rows [begin, end) of a whole grid
+void compute_links(const int* flags, int width, int height, int pitch,
+                   int begin, int end, int* links) {
+#pragma omp parallel for schedule(static)
+  for (int y = begin; y < end; y++) {
+    for (int x = 0; x < width; x++) {
+      host::work_item = x;
+      host::computeLinks(width, height, pitch, 0, y, width, 1, flags, links);
+    }
+  }
+}
+
+// simulationStep for the rows [begin, end) of a whole grid
+void step(const float* src, float* dest, const int* links, int width,
+          int height, int pitch, int begin, int end) {
+#pragma omp parallel for schedule(static)
+  for (int y = begin; y < end; y++) {
+    const int tile[2] = {0, y};
+    for (int x = 0; x < width; x++) {
+      host::work_item = x;
+      host::simulationStep(width, height, pitch, src, dest, links, tile);
+    }
+  }
+}
+
+// simulationStepAA for the rows [begin, end) of a whole grid
+void step_aa(float* f, const int* links, int width, int height, int pitch,
+             int begin, int end, bool odd) {
+#pragma omp parallel for schedule(static)
+  for (int y = begin; y < end; y++) {
+    const int tile[2] = {0, y};
+    for (int x = 0; x < width; x++) {
+      host::work_item = x;
+      host::simulationStepAA(width, height, pitch, odd, f, links, tile);
+    }
+  }
+}
 }
 
+
 BGK_OCL::BGK_OCL()
     : SimulationImplementation(0.0, 0.0, 0, 0),
-      getVelocityKernel(NULL),
-      getDensityKernel(NULL),
-      simulationStepKernel(NULL) {}
+      device(0),
+      hybrid(false),
+      context(NULL),
+      step_parity(0),
+      unexchanged(0),
+      host_first(0),
+      host_busy(0.0),
+      host_cost(0.0),
+      device_cost(0.0),
+      streaming(streaming_t::TWO_GRID) {}
 
-BGK_OCL::BGK_OCL(std::string filename)
+BGK_OCL::BGK_OCL(std::string filename, int device, bool hybrid)
     : SimulationImplementation(0, 0, 0, 0),
-      getVelocityKernel(NULL),
-      getDensityKernel(NULL),
-      simulationStepKernel(NULL) {
+      device(device),
+      hybrid(hybrid),
+      context(NULL),
+      step_parity(0),
+      unexchanged(0),
+      host_first(0),
+      host_busy(0.0),
+      host_cost(0.0),
+      device_cost(0.0),
+      streaming(streaming_t::TWO_GRID) {
   std::cout << filename << "\n";
   unsigned int size[2];
 
@@ -62,62 +220,231 @@ BGK_OCL::BGK_OCL(std::string filename)
 
   gridWidth = size[0];
   gridHeight = size[1];
-  width = size[0] / 0.001;
-  height = size[1] / 0.001;
-  vel = std::vector<float>(gridWidth * gridHeight * 2);
-  density = std::vector<float>(gridWidth * gridHeight);
+  width = size[0] * 0.001;
+  height = size[1] * 0.001;
 }
 
 BGK_OCL::BGK_OCL(double width, double height, size_t grid_width,
-                 size_t grid_height)
+                 size_t grid_height, int device, bool hybrid)
     : SimulationImplementation(width, height, grid_width, grid_height),
-      getVelocityKernel(NULL),
-      getDensityKernel(NULL),
-      simulationStepKernel(NULL),
-      vel(grid_width * grid_height * 2),
-      density(grid_width * grid_height) {}
+      device(device),
+      hybrid(hybrid),
+      context(NULL),
+      step_parity(0),
+      unexchanged(0),
+      host_first(0),
+      host_busy(0.0),
+      host_cost(0.0),
+      device_cost(0.0),
+      streaming(streaming_t::TWO_GRID) {}
 
-BGK_OCL::BGK_OCL(BGK_OCL& other) : SimulationImplementation(other), cl(0) {
+BGK_OCL::BGK_OCL(BGK_OCL& other)
+    : SimulationImplementation(other),
+      device(other.device),
+      hybrid(other.hybrid),
+      context(NULL),
+      step_parity(0),
+      unexchanged(0),
+      host_first(0),
+      host_busy(0.0),
+      host_cost(0.0),
+      device_cost(0.0),
+      streaming(other.streaming) {
   // TODO copy data
 }
 
 BGK_OCL::~BGK_OCL() {
-  delete getVelocityKernel;
-  delete getDensityKernel;
-  delete simulationStepKernel;
-  delete cl;
+  sync();
+  release_field(velocity_field);
+  release_field(density_field);
+  release_field(moments_field);
+  for (Slab& slab : slabs) {
+    release_slab(slab);
+  }
+  if (context != NULL) clReleaseContext(context);
 }
 
 // OpenCL initialization needs to be doen from the same thread that calls
 // the kernels later
 void BGK_OCL::init() {
   if (!OpenCLHelper::isOpenCLAvailable()) {
-    cout << "opencl library not found" << endl;
-    exit(-1);
+    throw std::runtime_error("opencl library not found");
   }
 
-  cl = new OpenCLHelper(0);
-  getVelocityKernel =
-      cl->buildKernel("./src/core/getVelocity.cl", "getVelocity");
-  getDensityKernel = cl->buildKernel("./src/core/getDensity.cl", "getDensity");
-  simulationStepKernel =
-      cl->buildKernel("./src/core/simulationStep.cl", "simulationStep");
+  pitch = OpenCLHelper::roundUp(row_alignment, gridWidth);
+  create_slabs();
+  build_kernels();
 
-  for (size_t i = 0; i < 9; i++) {
-    src[i] = cl->arrayFloat(gridWidth * gridHeight);
-    src[i]->createOnHost();
-    dst[i] = cl->arrayFloat(gridWidth * gridHeight);
-    dst[i]->createOnHost();
+  cl_int error;
+  for (Slab& slab : slabs) {
+    slab.src = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                              sizeof(float) * 9 * plane(slab), NULL, &error);
+    check(error, "clCreateBuffer");
+    if (streaming == streaming_t::TWO_GRID) {
+      slab.dst = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                sizeof(float) * 9 * plane(slab), NULL, &error);
+      check(error, "clCreateBuffer");
+    }
+    slab.flags = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                sizeof(cl_int) * plane(slab), NULL, &error);
+    check(error, "clCreateBuffer");
+    slab.links = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                                sizeof(cl_int) * plane(slab), NULL, &error);
+    check(error, "clCreateBuffer");
   }
-  flag_field = cl->arrayInt(gridWidth * gridHeight);
-  flag_field->createOnHost();
+  flags.assign(pitch * gridHeight, (int)cell_type::FLUID);
 
-  global_size[0] = OpenCLHelper::roundUp(64, gridWidth);
-  global_size[1] = OpenCLHelper::roundUp(64, gridHeight);
-  local_size[0] = 16;
-  local_size[1] = 16;
+  set_local_size(candidates[0][0], candidates[0][1]);
 
   do_clear();
+  tune();
+}
+
+// All devices share one context, so the halo copies are plain buffer copies.
+// The slabs get rows in proportion to the compute units of their devices,
+// but at least halo_rows each, so that all a slab sends is its own. A grid
+// too low for that uses fewer devices.
+//
+// A hybrid simulation has a single slab holding the whole grid, and owning
+// the rows above host_first. The host starts with a quarter of the grid,
+// balance() moves the boundary from there.
+void BGK_OCL::create_slabs() {
+  cl_platform_id platform;
+  check(clGetPlatformIDs(1, &platform, NULL), "clGetPlatformIDs");
+  cl_uint count = 0;
+  check(clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &count),
+        "clGetDeviceIDs");
+  std::vector<cl_device_id> ids(count);
+  check(clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, count, ids.data(), NULL),
+        "clGetDeviceIDs");
+  if (device != all_devices) {
+    if (device < 0 || device >= (int)count) {
+      throw std::runtime_error("no OpenCL device " + std::to_string(device));
+    }
+    ids.assign(1, ids[device]);
+  }
+  if (ids.empty()) throw std::runtime_error("no OpenCL device");
+  ids.resize(min(ids.size(), max<size_t>(1, gridHeight / halo_rows)));
+
+  cl_int error;
+  context = clCreateContext(0, ids.size(), ids.data(), NULL, NULL, &error);
+  check(error, "clCreateContext");
+
+  std::vector<size_t> units(ids.size());
+  size_t total_units = 0;
+  for (size_t k = 0; k < ids.size(); k++) {
+    cl_uint compute_units = 0;
+    clGetDeviceInfo(ids[k], CL_DEVICE_MAX_COMPUTE_UNITS, sizeof(cl_uint),
+                    &compute_units, NULL);
+    units[k] = max<cl_uint>(compute_units, 1);
+    total_units += units[k];
+  }
+
+  slabs.resize(ids.size());
+  size_t units_above = 0;
+  size_t first = 0;
+  for (size_t k = 0; k < slabs.size(); k++) {
+    Slab& slab = slabs[k];
+    const size_t below = slabs.size() - k - 1;
+    units_above += units[k];
+    size_t last = gridHeight * units_above / total_units;
+    last = min(max(last, first + halo_rows), gridHeight - below * halo_rows);
+    if (below == 0) last = gridHeight;
+
+    slab.device = ids[k];
+    slab.first = first;
+    slab.last = last;
+    slab.top = k == 0 ? 0 : first - halo_rows;
+    slab.height = (below == 0 ? last : last + halo_rows) - slab.top;
+    slab.profiled = hybrid;
+    slab.queue = clCreateCommandQueue(
+        context, slab.device, slab.profiled ? CL_QUEUE_PROFILING_ENABLE : 0,
+        &error);
+    check(error, "clCreateCommandQueue");
+    slab.read_queue = clCreateCommandQueue(context, slab.device, 0, &error);
+    check(error, "clCreateCommandQueue");
+    if (slabs.size() > 1 || hybrid) {
+      slab.copy_queue = clCreateCommandQueue(context, slab.device, 0, &error);
+      check(error, "clCreateCommandQueue");
+    }
+    first = last;
+  }
+
+  if (!hybrid) return;
+  host_first = min(max(gridHeight - gridHeight / 4, halo_rows),
+                   gridHeight - halo_rows);
+  slabs[0].last = host_first;
+}
+
+void BGK_OCL::release_slab(Slab& slab) {
+  for (cl_event event : slab.wait) {
+    clReleaseEvent(event);
+  }
+  if (slab.edge != NULL) clReleaseEvent(slab.edge);
+  if (slab.copied != NULL) clReleaseEvent(slab.copied);
+  release_events(slab.timed);
+  release_events(slab.settling);
+  release_step_kernels(slab);
+  for (auto& program : slab.step_programs) {
+    clReleaseProgram(program.second);
+  }
+  if (slab.draw_kernel != NULL) clReleaseKernel(slab.draw_kernel);
+  if (slab.draw_program != NULL) clReleaseProgram(slab.draw_program);
+  for (cl_mem buffer : {slab.src, slab.dst, slab.flags, slab.links,
+                        slab.tiles[EDGE], slab.tiles[INNER],
+                        slab.mask_buffer}) {
+    if (buffer != NULL) clReleaseMemObject(buffer);
+  }
+  for (cl_command_queue queue :
+       {slab.queue, slab.read_queue, slab.copy_queue}) {
+    if (queue != NULL) clReleaseCommandQueue(queue);
+  }
+}
+
+// Both tile lists of a slab get room for all of its tiles.
+void BGK_OCL::set_local_size(size_t x, size_t y) {
+  local_size[0] = x;
+  local_size[1] = y;
+
+  cl_int error;
+  for (Slab& slab : slabs) {
+    const size_t tiles = (OpenCLHelper::roundUp(x, gridWidth) / x) *
+                         (OpenCLHelper::roundUp(y, slab.height) / y);
+    for (cl_mem& buffer : slab.tiles) {
+      if (buffer != NULL) clReleaseMemObject(buffer);
+      buffer = clCreateBuffer(context, CL_MEM_READ_ONLY,
+                              sizeof(cl_int) * 2 * tiles, NULL, &error);
+      check(error, "clCreateBuffer");
+    }
+    slab.step_kernels_bound = false;
+  }
+}
+
+std::string BGK_OCL::device_key(cl_device_id id) {
+  char name[256] = {0};
+  char driver[256] = {0};
+  clGetDeviceInfo(id, CL_DEVICE_NAME, sizeof(name) - 1, name, NULL);
+  clGetDeviceInfo(id, CL_DRIVER_VERSION, sizeof(driver) - 1, driver, NULL);
+  // some drivers pad the name with blanks, which the cache lookup would drop
+  std::string key = std::string(name) + " " + driver;
+  key.erase(0, key.find_first_not_of(" \t"));
+  key.erase(key.find_last_not_of(" \t") + 1);
+  return key;
+}
+
+// The OpenCLHelper only looks at the first platform, so do we.
+int BGK_OCL::devices() {
+  if (!OpenCLHelper::isOpenCLAvailable()) return 0;
+  cl_platform_id platform;
+  cl_uint platforms = 0;
+  if (clGetPlatformIDs(1, &platform, &platforms) != CL_SUCCESS ||
+      platforms == 0)
+    return 0;
+  cl_uint count = 0;
+  if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, NULL, &count) !=
+      CL_SUCCESS)
+    return 0;
+  return count;
 }
 
 double dtime() {
@@ -128,83 +455,897 @@ double dtime() {
   return tseconds;
 }
 
+// Every candidate that fits in a work group of the kernels is timed over a
+// few iterations on the cleared grid, which is cleared again afterwards. A
+// hybrid simulation is tuned with the host's share switched off, so that the
+// timings are the device's alone and balance() keeps the boundary where it
+// is. The winner replaces the line of the same devices, grid size and slabs
+// in tuning_cache, so the next start with them reuses it without timing
+// anything.
+void BGK_OCL::tune() {
+  std::string key;
+  size_t max_size = 256;
+  for (size_t k = 0; k < slabs.size(); k++) {
+    Slab& slab = slabs[k];
+    key += (key.empty() ? "" : " + ") + device_key(slab.device);
+    // every kernel launched with local_size limits it, down from what the
+    // device allows, depending on the registers it needs
+    std::vector<cl_kernel> kernels = {velocity_field.kernel[k],
+                                      density_field.kernel[k],
+                                      moments_field.kernel[k]};
+    for (int i = 0; i < 2; i++) {
+      for (int part = EDGE; part <= INNER; part++) {
+        kernels.push_back(slab.step_kernel[i][part]);
+        kernels.push_back(slab.step_aa_kernel[i][part]);
+      }
+    }
+    for (cl_kernel kernel : kernels) {
+      size_t kernel_max = 0;
+      check(clGetKernelWorkGroupInfo(kernel, slab.device,
+                                     CL_KERNEL_WORK_GROUP_SIZE,
+                                     sizeof(kernel_max), &kernel_max, NULL),
+            "clGetKernelWorkGroupInfo");
+      max_size = min(max_size, kernel_max);
+    }
+  }
+  // the rows of each slab, which decide the work groups as much as the
+  // grid size does
+  std::ostringstream layout;
+  layout << (hybrid ? "hybrid:" : "slabs:");
+  for (size_t i = 0; i < slabs.size(); i++) {
+    layout << (i ? "," : "") << slabs[i].first << "-" << slabs[i].last;
+  }
+  const std::string dir = cache_directory();
+  const std::string cache = dir.empty() ? "" : dir + "/" + tuning_cache;
+
+  std::vector<std::string> lines;
+  std::ifstream in(cache);
+  std::string line;
+  while (std::getline(in, line)) {
+    std::istringstream entry(line);
+    size_t w, h, x, y;
+    std::string slabs_used, name;
+    std::getline(entry >> w >> h >> x >> y >> slabs_used >> std::ws, name);
+    const bool same = entry && w == gridWidth && h == gridHeight &&
+                      slabs_used == layout.str() && name == key;
+    if (!same) {
+      lines.push_back(line);
+    } else if (x * y <= max_size) {
+      set_local_size(x, y);
+      update_tiles();
+      return;
+    }
+  }
+  in.close();
+
+  const bool was_hybrid = hybrid;
+  hybrid = false;
+  size_t best[2] = {local_size[0], local_size[1]};
+  double best_time = -1.0;
+  for (auto& candidate : candidates) {
+    if (candidate[0] * candidate[1] > max_size) continue;
+    set_local_size(candidate[0], candidate[1]);
+    update_tiles();
+
+    one_iteration();
+    double start = dtime();
+    for (int i = 0; i < tuning_steps; i++) {
+      one_iteration();
+    }
+    double time = dtime() - start;
+    if (best_time < 0.0 || time < best_time) {
+      best_time = time;
+      best[0] = candidate[0];
+      best[1] = candidate[1];
+    }
+  }
+  hybrid = was_hybrid;
+  // the timings of the tuning steps are no measure for measure()
+  for (Slab& slab : slabs) {
+    release_events(slab.timed);
+    release_events(slab.settling);
+    slab.settling_rows = 0;
+    slab.settling_steps = 0;
+  }
+  host_busy = 0.0;
+
+  set_local_size(best[0], best[1]);
+  do_clear();
+
+  if (cache.empty()) return;
+  std::ostringstream entry;
+  entry << gridWidth << " " << gridHeight << " " << best[0] << " " << best[1]
+        << " " << layout.str() << " " << key;
+  lines.push_back(entry.str());
+  // written under a temporary name first, like the program binaries, so
+  // that a concurrent start reads either the old or the new cache
+  const std::string partial = cache + ".part";
+  {
+    std::ofstream out(partial);
+    for (const std::string& kept : lines) {
+      out << kept << "\n";
+    }
+    if (!out) return;
+  }
+  rename(partial.c_str(), cache.c_str());
+}
+
+// The binary of every program built from source is saved in the cache
+// directory, named after a hash of the device, driver, build options and
+// source, and reused by the next start with the same hash. A binary the
+// driver refuses, e.g. after an update that kept its version string, is
+// rebuilt from source and overwritten.
+cl_program BGK_OCL::build_program(cl_device_id id, const std::string& name,
+                                  const char* source,
+                                  const std::string& options) {
+  const std::string dir = cache_directory();
+  char hash[17];
+  snprintf(hash, sizeof(hash), "%016llx",
+           (unsigned long long)fnv1a(device_key(id) + "\n" + options + "\n" +
+                                     source));
+  const std::string cache =
+      dir.empty() ? "" : dir + "/" + name + "-" + hash + ".bin";
+
+  cl_int error;
+  std::ifstream cached(cache, std::ios::binary);
+  if (cached) {
+    const std::string binary((std::istreambuf_iterator<char>(cached)),
+                             std::istreambuf_iterator<char>());
+    const unsigned char* binary_ptr = (const unsigned char*)binary.data();
+    size_t binary_size = binary.size();
+    cl_int status;
+    cl_program program = clCreateProgramWithBinary(
+        context, 1, &id, &binary_size, &binary_ptr, &status, &error);
+    if (error == CL_SUCCESS && status == CL_SUCCESS &&
+        clBuildProgram(program, 1, &id, options.c_str(), NULL, NULL) ==
+            CL_SUCCESS) {
+      return program;
+    }
+    if (error == CL_SUCCESS) clReleaseProgram(program);
+  }
+
+  size_t source_size = strlen(source);
+  cl_program program =
+      clCreateProgramWithSource(context, 1, &source, &source_size, &error);
+  check(error, "clCreateProgramWithSource");
+  error = clBuildProgram(program, 1, &id, options.c_str(), NULL, NULL);
+  if (error != CL_SUCCESS) {
+    char log[10240] = {0};
+    clGetProgramBuildInfo(program, id, CL_PROGRAM_BUILD_LOG, sizeof(log) - 1,
+                          log, NULL);
+    clReleaseProgram(program);
+    throw std::runtime_error(name + " build failed: " + std::to_string(error) +
+                             "\n" + log);
+  }
+  if (cache.empty()) return program;
+
+  size_t binary_size = 0;
+  clGetProgramInfo(program, CL_PROGRAM_BINARY_SIZES, sizeof(binary_size),
+                   &binary_size, NULL);
+  if (binary_size == 0) return program;
+  std::vector<unsigned char> binary(binary_size);
+  unsigned char* binary_ptr = binary.data();
+  if (clGetProgramInfo(program, CL_PROGRAM_BINARIES, sizeof(binary_ptr),
+                       &binary_ptr, NULL) != CL_SUCCESS) {
+    return program;
+  }
+  // written under a temporary name first, so that a concurrent start never
+  // reads half a binary
+  const std::string partial = cache + ".part";
+  {
+    std::ofstream out(partial, std::ios::binary);
+    out.write((const char*)binary.data(), binary.size());
+    if (!out) return program;
+  }
+  rename(partial.c_str(), cache.c_str());
+  return program;
+}
+
+// CLKernel sets every argument again for each run, and allocates buffers for
+// the output of getVelocity and getDensity each time. So the kernels are
+// built here as plain cl_kernels instead: one of each field kernel, writing
+// to a buffer of its own, and the brush kernel, for each slab. The
+// simulation kernels are built by specialize().
+void BGK_OCL::build_kernels() {
+  cl_int error;
+  for (Slab& slab : slabs) {
+    slab.draw_program = build_program(slab.device, "drawMask", drawMask_cl);
+    slab.draw_kernel = clCreateKernel(slab.draw_program, "drawMask", &error);
+    check(error, "clCreateKernel");
+  }
+  create_field(velocity_field, getVelocity_cl, "getVelocity",
+               sizeof(Vec2D<float>));
+  create_field(density_field, getDensity_cl, "getDensity", sizeof(float));
+  create_field(moments_field, getFields_cl, "getFields", 3 * sizeof(float));
+}
+
+// simulationStep.cl is built with the slab's dimensions, the relaxation rate
+// and the boundary types in use as constants. The builds are kept for the
+// lifetime of the simulation, so a change that is undone later, like a
+// clear after an image with no copy cells, costs no further build. Called
+// whenever the flags have been reset.
+void BGK_OCL::specialize(Slab& slab) {
+  bool has_source = false;
+  bool has_copy = false;
+  for (size_t iy = slab.top; iy < slab.top + slab.height; ++iy) {
+    for (size_t ix = 0; ix < gridWidth; ++ix) {
+      const int type = flags[cell(ix, iy)];
+      has_source |= type == (int)cell_type::SOURCE;
+      has_copy |= type == (int)cell_type::COPY;
+    }
+  }
+
+  char options[256];
+  snprintf(options, sizeof(options),
+           "-DWIDTH=%d -DHEIGHT=%d -DPITCH=%d -DOMEGA=%.9gf -DHAS_SRC=%d "
+           "-DHAS_COPY=%d",
+           (int)gridWidth, (int)slab.height, (int)pitch, omega, has_source,
+           has_copy);
+  if (slab.step_program != NULL && slab.step_options == options) return;
+
+  cl_program& program = slab.step_programs[options];
+  if (program == NULL) {
+    program = build_program(slab.device, "simulationStep", simulationStep_cl,
+                            options);
+  }
+  release_step_kernels(slab);
+  slab.step_program = program;
+  slab.step_options = options;
+
+  cl_int error;
+  for (int i = 0; i < 2; i++) {
+    for (int part = EDGE; part <= INNER; part++) {
+      slab.step_kernel[i][part] =
+          clCreateKernel(slab.step_program, "simulationStep", &error);
+      check(error, "clCreateKernel");
+      slab.step_aa_kernel[i][part] =
+          clCreateKernel(slab.step_program, "simulationStepAA", &error);
+      check(error, "clCreateKernel");
+    }
+  }
+  slab.links_kernel =
+      clCreateKernel(slab.step_program, "computeLinks", &error);
+  check(error, "clCreateKernel");
+  slab.step_kernels_bound = false;
+}
+
+void BGK_OCL::release_step_kernels(Slab& slab) {
+  for (int i = 0; i < 2; i++) {
+    for (int part = EDGE; part <= INNER; part++) {
+      cl_kernel& step = slab.step_kernel[i][part];
+      cl_kernel& step_aa = slab.step_aa_kernel[i][part];
+      if (step != NULL) clReleaseKernel(step);
+      if (step_aa != NULL) clReleaseKernel(step_aa);
+      step = step_aa = NULL;
+    }
+  }
+  if (slab.links_kernel != NULL) clReleaseKernel(slab.links_kernel);
+  slab.links_kernel = NULL;
+}
+
+// The pinned buffer stays mapped for the whole lifetime of the simulation,
+// so reads into field.host are DMA transfers without any staging by the
+// driver.
+void BGK_OCL::create_field(Field& field, const char* source,
+                           const char* kernel, size_t cell_size) {
+  cl_int error;
+  field.cell_size = cell_size;
+  for (Slab& slab : slabs) {
+    field.program.push_back(build_program(slab.device, kernel, source));
+    field.kernel.push_back(
+        clCreateKernel(field.program.back(), kernel, &error));
+    check(error, "clCreateKernel");
+    field.buffer.push_back(clCreateBuffer(context, CL_MEM_WRITE_ONLY,
+                                          cell_size * gridWidth * slab.height,
+                                          NULL, &error));
+    check(error, "clCreateBuffer");
+  }
+  const size_t size = cell_size * gridWidth * gridHeight;
+  field.pinned = clCreateBuffer(
+      context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size, NULL, &error);
+  check(error, "clCreateBuffer");
+  field.host = clEnqueueMapBuffer(slabs[0].read_queue, field.pinned, CL_TRUE,
+                                  CL_MAP_READ | CL_MAP_WRITE, 0, size, 0,
+                                  NULL, NULL, &error);
+  check(error, "clEnqueueMapBuffer");
+}
+
+void BGK_OCL::release_field(Field& field) {
+  if (field.host != NULL) {
+    clEnqueueUnmapMemObject(slabs[0].read_queue, field.pinned, field.host, 0,
+                            NULL, NULL);
+    clFinish(slabs[0].read_queue);
+  }
+  if (field.pinned != NULL) clReleaseMemObject(field.pinned);
+  for (cl_mem buffer : field.buffer) {
+    clReleaseMemObject(buffer);
+  }
+  for (cl_kernel kernel : field.kernel) {
+    clReleaseKernel(kernel);
+  }
+  for (cl_program program : field.program) {
+    clReleaseProgram(program);
+  }
+}
+
+// The field kernel of each slab is enqueued behind the steps still pending
+// there, and only the rows the slab owns are read back, on its read_queue,
+// into their place in the pinned memory. dest gets a single copy from there
+// once all slabs' reads are done, unless dest is NULL, in which case the
+// caller takes the values from field.host itself. src changes with every
+// step, so the arguments are set each time.
+void BGK_OCL::download(Field& field, void* dest) {
+  const size_t row = field.cell_size * gridWidth;
+  std::vector<cl_event> reads;
+  for (size_t k = 0; k < slabs.size(); k++) {
+    Slab& slab = slabs[k];
+    const int grid_width = gridWidth;
+    const int grid_height = slab.height;
+    const int grid_pitch = pitch;
+    cl_uint n = 0;
+    set_arg(field.kernel[k], n, sizeof(cl_mem), &slab.src);
+    set_arg(field.kernel[k], n, sizeof(cl_mem), &field.buffer[k]);
+    set_arg(field.kernel[k], n, sizeof(int), &grid_width);
+    set_arg(field.kernel[k], n, sizeof(int), &grid_height);
+    set_arg(field.kernel[k], n, sizeof(int), &grid_pitch);
+
+    const size_t launch_size[2] = {
+        (size_t)OpenCLHelper::roundUp(local_size[0], gridWidth),
+        (size_t)OpenCLHelper::roundUp(local_size[1], slab.height)};
+    cl_event computed, read;
+    enqueue(slab, field.kernel[k], launch_size, local_size, &computed);
+    clFlush(slab.queue);
+    check(clEnqueueReadBuffer(
+        slab.read_queue, field.buffer[k], CL_FALSE,
+        row * (slab.first - slab.top), row * (slab.last - slab.first),
+        (char*)field.host + row * slab.first, 1, &computed, &read),
+          "clEnqueueReadBuffer");
+    clFlush(slab.read_queue);
+    clReleaseEvent(computed);
+    reads.push_back(read);
+  }
+  check(clWaitForEvents(reads.size(), reads.data()), "clWaitForEvents");
+  release_events(reads);
+
+  if (dest != NULL) std::memcpy(dest, field.host, row * gridHeight);
+}
+
+void BGK_OCL::bind_step_kernels(Slab& slab) {
+  const int grid_width = gridWidth;
+  const int grid_height = slab.height;
+  const int grid_pitch = pitch;
+
+  for (int part = EDGE; part <= INNER; part++) {
+    if (streaming == streaming_t::IN_PLACE) {
+      for (int odd = 0; odd < 2; odd++) {
+        cl_kernel kernel = slab.step_aa_kernel[odd][part];
+        cl_uint n = 0;
+        set_arg(kernel, n, sizeof(int), &grid_width);
+        set_arg(kernel, n, sizeof(int), &grid_height);
+        set_arg(kernel, n, sizeof(int), &grid_pitch);
+        set_arg(kernel, n, sizeof(int), &odd);
+        set_arg(kernel, n, sizeof(cl_mem), &slab.src);
+        set_arg(kernel, n, sizeof(cl_mem), &slab.links);
+        set_arg(kernel, n, sizeof(cl_mem), &slab.tiles[part]);
+      }
+    } else {
+      for (int parity = 0; parity < 2; parity++) {
+        cl_kernel kernel = slab.step_kernel[parity][part];
+        cl_uint n = 0;
+        set_arg(kernel, n, sizeof(int), &grid_width);
+        set_arg(kernel, n, sizeof(int), &grid_height);
+        set_arg(kernel, n, sizeof(int), &grid_pitch);
+        set_arg(kernel, n, sizeof(cl_mem), parity == 0 ? &slab.src : &slab.dst);
+        set_arg(kernel, n, sizeof(cl_mem), parity == 0 ? &slab.dst : &slab.src);
+        set_arg(kernel, n, sizeof(cl_mem), &slab.links);
+        set_arg(kernel, n, sizeof(cl_mem), &slab.tiles[part]);
+      }
+    }
+  }
+  slab.step_kernels_bound = true;
+}
+
+// Every kernel on a slab's queue waits for the halo copies the previous
+// exchange() made into the slab or out of it.
+void BGK_OCL::enqueue(Slab& slab, cl_kernel kernel, const size_t* launch_size,
+                      const size_t* local, cl_event* event) {
+  cl_int error = clEnqueueNDRangeKernel(
+      slab.queue, kernel, 2, NULL, launch_size, local, slab.wait.size(),
+      slab.wait.empty() ? NULL : slab.wait.data(), event);
+  release_events(slab.wait);
+  check(error, "clEnqueueNDRangeKernel");
+}
+
+// One work group per tile of the given part. If it has none, what the
+// kernel would have waited for is passed on to the queue, and event, if
+// given, completes with the commands before. On a profiled slab, the
+// kernel's event is kept for busy_time().
+void BGK_OCL::enqueue_tiles(Slab& slab, cl_kernel kernel, int part,
+                            cl_event* event) {
+  if (slab.active_tiles[part] > 0) {
+    const size_t launch_size[2] = {slab.active_tiles[part] * local_size[0],
+                                   local_size[1]};
+    cl_event timed = NULL;
+    enqueue(slab, kernel, launch_size, local_size,
+            slab.profiled ? &timed : event);
+    if (timed == NULL) return;
+    slab.timed.push_back(timed);
+    if (event == NULL) return;
+    clRetainEvent(timed);
+    *event = timed;
+    return;
+  }
+  if (!slab.wait.empty()) {
+    check(clEnqueueWaitForEvents(
+        slab.queue, slab.wait.size(), slab.wait.data()),
+          "clEnqueueWaitForEvents");
+    release_events(slab.wait);
+  }
+  if (event != NULL) {
+    check(clEnqueueMarker(slab.queue, event), "clEnqueueMarker");
+  }
+}
+
+// In place, each call performs two timesteps, so that the populations are in
+// their natural order again when the other kernels read them. With two
+// grids, src and dst are swapped after every step and step_parity picks the
+// kernel instances whose arguments match. The EDGE tiles run first, and if
+// the step is followed by an exchange(), slab.edge completes with them, so
+// that the copies start while the INNER tiles are still running. events, if
+// given, gets an event per slab completing with the step.
+void BGK_OCL::enqueue_step(bool exchanging, std::vector<cl_event>* events) {
+  for (Slab& slab : slabs) {
+    cl_kernel* kernel;
+    if (streaming == streaming_t::IN_PLACE) {
+      enqueue_tiles(slab, slab.step_aa_kernel[0][EDGE], EDGE, NULL);
+      enqueue_tiles(slab, slab.step_aa_kernel[0][INNER], INNER, NULL);
+      kernel = slab.step_aa_kernel[1];
+    } else {
+      kernel = slab.step_kernel[step_parity];
+    }
+    enqueue_tiles(slab, kernel[EDGE], EDGE, exchanging ? &slab.edge : NULL);
+    cl_event done = NULL;
+    enqueue_tiles(slab, kernel[INNER], INNER, events != NULL ? &done : NULL);
+    if (events != NULL) events->push_back(done);
+    if (streaming == streaming_t::TWO_GRID) std::swap(slab.src, slab.dst);
+  }
+  if (streaming == streaming_t::TWO_GRID) step_parity ^= 1;
+}
+
+// Each slab gets the halo_rows rows beyond its boundaries, all nine planes
+// of them, from the slabs owning them. The copies into a slab are enqueued
+// on its copy_queue once the EDGE tiles on both sides are done, and every
+// slab they read from or write to waits for them before its next kernel.
+void BGK_OCL::exchange() {
+  const size_t halo = sizeof(float) * pitch * halo_rows;
+  for (size_t k = 0; k < slabs.size(); k++) {
+    Slab& slab = slabs[k];
+    std::vector<const Slab*> neighbors;
+    if (k > 0) neighbors.push_back(&slabs[k - 1]);
+    if (k + 1 < slabs.size()) neighbors.push_back(&slabs[k + 1]);
+
+    std::vector<cl_event> ready(1, slab.edge);
+    for (const Slab* from : neighbors) {
+      ready.push_back(from->edge);
+    }
+    if (slab.copied != NULL) clReleaseEvent(slab.copied);
+    slab.copied = NULL;
+
+    size_t copies = 0;
+    for (const Slab* from : neighbors) {
+      // the halo above starts at the slab's top, the one below at its last
+      const size_t row = from->first < slab.first ? slab.top : slab.last;
+      for (size_t i = 0; i < 9; i++) {
+        const size_t from_offset = i * plane(*from) + cell(0, row - from->top);
+        const size_t to_offset = i * plane(slab) + cell(0, row - slab.top);
+        const bool last = ++copies == 9 * neighbors.size();
+        check(clEnqueueCopyBuffer(
+            slab.copy_queue, from->src, slab.src, sizeof(float) * from_offset,
+            sizeof(float) * to_offset, halo, copies == 1 ? ready.size() : 0,
+            copies == 1 ? ready.data() : NULL, last ? &slab.copied : NULL),
+              "clEnqueueCopyBuffer");
+      }
+    }
+    clFlush(slab.copy_queue);
+  }
+
+  for (size_t k = 0; k < slabs.size(); k++) {
+    for (size_t j = k == 0 ? 0 : k - 1; j < min(k + 2, slabs.size()); j++) {
+      clRetainEvent(slabs[j].copied);
+      slabs[k].wait.push_back(slabs[j].copied);
+    }
+  }
+  for (Slab& slab : slabs) {
+    clReleaseEvent(slab.edge);
+    slab.edge = NULL;
+  }
+  unexchanged = 0;
+}
+
+// The queues are in order, so the steps need no events among each other.
+// The slabs exchange their halos every halo_rows timesteps, and after the
+// last step, so that the grid is whole again when the call returns. Only the
+// last commands get events, and the host waits for the previous call's steps
+// after enqueuing these. That keeps one batch of steps queued behind the
+// running one, without letting the host run arbitrarily far ahead.
+//
+// A hybrid simulation runs the host's share of each step while the device
+// works on its own, and exchanges halos with the host instead.
+void BGK_OCL::iterate(size_t steps) {
+  if (steps == 0) return;
+  if (hybrid) balance();
+  bool bound = true;
+  for (Slab& slab : slabs) {
+    bound &= slab.step_kernels_bound;
+  }
+  // all slabs swap their grids together, so they are bound together
+  if (!bound) {
+    for (Slab& slab : slabs) {
+      bind_step_kernels(slab);
+    }
+    step_parity = 0;
+  }
+
+  const size_t timesteps = streaming == streaming_t::IN_PLACE ? 2 : 1;
+  std::vector<cl_event> last;
+  for (size_t n = 0; n < steps; n++) {
+    const bool final_step = n + 1 == steps;
+    unexchanged += timesteps;
+    const bool exchanging = (slabs.size() > 1 || hybrid) &&
+                            (unexchanged >= halo_rows || final_step);
+    enqueue_step(exchanging, final_step ? &last : NULL);
+    if (hybrid) {
+      clFlush(slabs[0].queue);
+      const double start = dtime();
+      host_step();
+      host_busy += dtime() - start;
+    }
+    if (exchanging) {
+      if (hybrid) {
+        exchange_host();
+      } else {
+        exchange();
+      }
+    }
+  }
+  for (Slab& slab : slabs) {
+    clFlush(slab.queue);
+    if (slab.copied == NULL) continue;
+    clRetainEvent(slab.copied);
+    last.push_back(slab.copied);
+  }
+
+  sync();
+  pending = last;
+  if (hybrid) measure(steps);
+}
+
 void BGK_OCL::one_iteration() {
-  simulationStepKernel->input((int)gridWidth);
-  simulationStepKernel->input((int)gridHeight);
-  for (size_t i = 0; i < 9; i++) {
-    simulationStepKernel->input(src[i]);
+  iterate(1);
+  sync();
+}
+
+void BGK_OCL::sync() {
+  if (pending.empty()) return;
+  check(clWaitForEvents(pending.size(), pending.data()), "clWaitForEvents");
+  release_events(pending);
+}
+
+// The host computes the halo_rows rows above host_first as well, like a
+// slab does with its halo.
+void BGK_OCL::host_step() {
+  const int begin = host_first - halo_rows;
+  if (streaming == streaming_t::IN_PLACE) {
+    for (bool odd : {false, true}) {
+      step_aa(host_src.data(), host_links.data(), gridWidth, gridHeight,
+              pitch, begin, gridHeight, odd);
+    }
+    return;
   }
+  step(host_src.data(), host_dst.data(), host_links.data(), gridWidth,
+       gridHeight, pitch, begin, gridHeight);
+  std::swap(host_src, host_dst);
+}
+
+// The counterpart of exchange() between the slab and the host: the device's
+// last rows are read into the host's halo, and the host's first rows written
+// into the device's, once the EDGE tiles are done. The host needs them for
+// its next step, so it waits for the copies.
+void BGK_OCL::exchange_host() {
+  Slab& slab = slabs[0];
+  const size_t halo = sizeof(float) * pitch * halo_rows;
   for (size_t i = 0; i < 9; i++) {
-    simulationStepKernel->output(dst[i]);
+    const size_t above = i * plane(slab) + cell(0, host_first - halo_rows);
+    const size_t below = i * plane(slab) + cell(0, host_first);
+    check(clEnqueueReadBuffer(
+        slab.copy_queue, slab.src, CL_FALSE, sizeof(float) * above, halo,
+        &host_src[above], i == 0 ? 1 : 0, i == 0 ? &slab.edge : NULL, NULL),
+          "clEnqueueReadBuffer");
+    check(clEnqueueWriteBuffer(
+        slab.copy_queue, slab.src, CL_FALSE, sizeof(float) * below, halo,
+        &host_src[below], 0, NULL, NULL),
+          "clEnqueueWriteBuffer");
   }
-  simulationStepKernel->input(flag_field);
+  check(clFinish(slab.copy_queue), "clFinish");
+  clReleaseEvent(slab.edge);
+  slab.edge = NULL;
+  unexchanged = 0;
+}
 
-  simulationStepKernel->run(2, global_size, local_size);
-  for (size_t i = 0; i < 9; i++) {
-    std::swap(src[i], dst[i]);
+// Sum of the run times of the given step kernels, which must be done.
+double BGK_OCL::busy_time(std::vector<cl_event>& events) {
+  double busy = 0.0;
+  for (cl_event event : events) {
+    cl_ulong start = 0, end = 0;
+    if (clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_START,
+                                sizeof(start), &start, NULL) == CL_SUCCESS &&
+        clGetEventProfilingInfo(event, CL_PROFILING_COMMAND_END, sizeof(end),
+                                &end, NULL) == CL_SUCCESS) {
+      busy += (end - start) * 1.0e-9;
+    }
+  }
+  release_events(events);
+  return busy;
+}
+
+// Called after each batch of steps, once sync() waited for the batch
+// before. The host is done with its share of the new batch, the device
+// maybe not, so its time is taken from the batch before, which costs no
+// wait and keeps the new one running. Each side's time per row and step
+// of its own batch gives its cost per row, smoothed over the batches, which
+// differ in size.
+void BGK_OCL::measure(size_t steps) {
+  Slab& slab = slabs[0];
+  const double device_busy = busy_time(slab.settling);
+  if (device_busy > 0.0 && slab.settling_rows > 0 && slab.settling_steps > 0) {
+    const double device_row =
+        device_busy / (slab.settling_rows * slab.settling_steps);
+    device_cost =
+        device_cost > 0.0 ? (device_cost + device_row) / 2 : device_row;
   }
+  slab.settling.swap(slab.timed);
+  slab.settling_rows = host_first + halo_rows;
+  slab.settling_steps = steps;
 
-  simulationStepKernel->finishPending();
+  const double host = host_busy;
+  host_busy = 0.0;
+  if (host <= 0.0) return;
+  const double host_row =
+      host / ((gridHeight - host_first + halo_rows) * steps);
+  host_cost = host_cost > 0.0 ? (host_cost + host_row) / 2 : host_row;
 }
-void BGK_OCL::setFields(const size_t ix, const size_t iy, const float* val,
-                        const int type) {
-  for (size_t i = 0; i < 9; i++) {
-    (*(src[i]))[iy * gridWidth + ix] = val[i];
-    (*(dst[i]))[iy * gridWidth + ix] = val[i];
+
+// Called before each batch of steps. The boundary moves to where both sides
+// would take equally long, going by the costs of measure(), unless that is
+// only a few rows away, which is within the noise of the measurement and
+// not worth the copies.
+void BGK_OCL::balance() {
+  if (device_cost <= 0.0 || host_cost <= 0.0) return;
+  size_t first = gridHeight * host_cost / (host_cost + device_cost);
+  first = min(max(first, halo_rows), gridHeight - halo_rows);
+  const size_t tolerance = max(halo_rows, gridHeight / 50);
+  if (max(first, host_first) - min(first, host_first) > tolerance) {
+    move_boundary(first);
+  }
+}
+
+// Both sides hold the whole grid, so moving the boundary only copies the
+// rows changing hands, plus the halo_rows beyond them that the side taking
+// them over reads, from the side that has them up to date.
+void BGK_OCL::move_boundary(size_t first) {
+  Slab& slab = slabs[0];
+  const bool to_host = first < host_first;
+  const size_t begin = to_host ? first - halo_rows : host_first;
+  const size_t end = to_host ? host_first : first + halo_rows;
+  const size_t size = sizeof(float) * pitch * (end - begin);
+
+  std::vector<std::pair<cl_mem, float*>> grids = {{slab.src, host_src.data()}};
+  if (streaming == streaming_t::TWO_GRID) {
+    grids.push_back({slab.dst, host_dst.data()});
+  }
+  for (auto& grid : grids) {
+    for (size_t i = 0; i < 9; i++) {
+      const size_t offset = i * plane(slab) + cell(0, begin);
+      if (to_host) {
+        check(clEnqueueReadBuffer(
+            slab.queue, grid.first, CL_TRUE, sizeof(float) * offset, size,
+            grid.second + offset, 0, NULL, NULL),
+              "clEnqueueReadBuffer");
+      } else {
+        check(clEnqueueWriteBuffer(
+            slab.queue, grid.first, CL_TRUE, sizeof(float) * offset, size,
+            grid.second + offset, 0, NULL, NULL),
+              "clEnqueueWriteBuffer");
+      }
+    }
   }
-  (*flag_field)[iy * gridWidth + ix] = type;
+  host_first = first;
+  slab.last = first;
+  update_tiles();
+}
+
+// The populations of every cell in the given rows are those of fluid at
+// rest, except for source and copy cells, which start with those of the
+// inflow and outflow.
+std::vector<float> BGK_OCL::initial_fields(size_t top, size_t height) const {
+  const size_t plane = pitch * height;
+  std::vector<float> f(9 * plane, 0.0f);
+  for (size_t iy = 0; iy < height; ++iy) {
+    for (size_t ix = 0; ix < gridWidth; ++ix) {
+      const int type = flags[cell(ix, top + iy)];
+      const float* val = type == (int)cell_type::SOURCE
+                             ? source
+                             : type == (int)cell_type::COPY ? drain : fluid;
+      for (size_t i = 0; i < 9; i++) {
+        f[i * plane + cell(ix, iy)] = val[i];
+      }
+    }
+  }
+  return f;
+}
+
+void BGK_OCL::upload_fields(Slab& slab) {
+  const std::vector<float> f = initial_fields(slab.top, slab.height);
+
+  for (cl_mem buffer : {slab.src, slab.dst}) {
+    if (buffer == NULL) continue;
+    check(
+        clEnqueueWriteBuffer(slab.queue, buffer, CL_TRUE, 0,
+                             sizeof(float) * f.size(), f.data(), 0, NULL,
+                             NULL),
+          "clEnqueueWriteBuffer");
+  }
+  check(clEnqueueWriteBuffer(
+      slab.queue, slab.flags, CL_TRUE, 0, sizeof(cl_int) * plane(slab),
+      &flags[cell(0, slab.top)], 0, NULL, NULL),
+        "clEnqueueWriteBuffer");
+}
+
+// The simulation kernels do nothing for no slip cells, so tiles made of no
+// slip cells alone (or lying outside the grid) are left out of the tile
+// lists, which hold the x and y offset of every other tile. A slab computes
+// the rows it owns and halo_rows beyond each boundary. The EDGE list of a
+// slab takes the tiles within reach of the rows it exchanges, that is those
+// reading or writing them in a step, and the INNER list the others. Tiles
+// left out keep their dense storage, so that the halos stay whole rows.
+void BGK_OCL::update_tiles() {
+  const int reach = halo_rows + 1;
+  for (Slab& slab : slabs) {
+    const int owned_top = slab.first - slab.top;
+    const int owned_bottom = slab.last - slab.top;
+    const int begin = slab.first > 0 ? owned_top - halo_rows : 0;
+    const int end =
+        slab.last < gridHeight ? owned_bottom + halo_rows : slab.height;
+    const int edge_top = slab.first > 0 ? owned_top + reach : begin;
+    const int edge_bottom = slab.last < gridHeight ? owned_bottom - reach : end;
+
+    std::vector<int> list[2];
+    for (size_t ty = begin; (int)ty < end; ty += local_size[1]) {
+      const size_t tile_bottom = min(ty + local_size[1], slab.height);
+      for (size_t tx = 0; tx < gridWidth; tx += local_size[0]) {
+        bool active = false;
+        for (size_t iy = ty; iy < tile_bottom; iy++) {
+          for (size_t ix = tx; ix < min(tx + local_size[0], gridWidth);
+               ix++) {
+            if (flags[cell(ix, slab.top + iy)] != (int)cell_type::NO_SLIP) {
+              active = true;
+            }
+          }
+        }
+        if (!active) continue;
+        const bool edge =
+            (int)ty < edge_top || (int)tile_bottom > edge_bottom;
+        list[edge ? EDGE : INNER].push_back(tx);
+        list[edge ? EDGE : INNER].push_back(ty);
+      }
+    }
+
+    for (int part = EDGE; part <= INNER; part++) {
+      slab.active_tiles[part] = list[part].size() / 2;
+      if (list[part].empty()) continue;
+      check(clEnqueueWriteBuffer(
+          slab.queue, slab.tiles[part], CL_TRUE, 0,
+          sizeof(cl_int) * list[part].size(), list[part].data(), 0, NULL,
+          NULL),
+            "clEnqueueWriteBuffer");
+    }
+  }
+}
+
+// computeLinks over the given rectangle of the slab, clipped to it by the
+// kernel.
+void BGK_OCL::update_links(Slab& slab, int left, int top, size_t w,
+                           size_t h) {
+  const int grid_width = gridWidth;
+  const int grid_height = slab.height;
+  const int grid_pitch = pitch;
+  const int region_width = w;
+  const int region_height = h;
+  cl_uint n = 0;
+  set_arg(slab.links_kernel, n, sizeof(int), &grid_width);
+  set_arg(slab.links_kernel, n, sizeof(int), &grid_height);
+  set_arg(slab.links_kernel, n, sizeof(int), &grid_pitch);
+  set_arg(slab.links_kernel, n, sizeof(int), &left);
+  set_arg(slab.links_kernel, n, sizeof(int), &top);
+  set_arg(slab.links_kernel, n, sizeof(int), &region_width);
+  set_arg(slab.links_kernel, n, sizeof(int), &region_height);
+  set_arg(slab.links_kernel, n, sizeof(cl_mem), &slab.flags);
+  set_arg(slab.links_kernel, n, sizeof(cl_mem), &slab.links);
+
+  const size_t size[2] = {w, h};
+  enqueue(slab, slab.links_kernel, size, NULL, NULL);
+}
+
+auto BGK_OCL::lattice_viscosity() -> double {
+  return (1.0 / omega - 0.5) / 3.0;
+}
+
+auto BGK_OCL::timesteps_per_iteration() -> size_t {
+  return streaming == streaming_t::IN_PLACE ? 2 : 1;
 }
 
 void BGK_OCL::do_clear() {
+  sync();
   for (size_t iy = 0; iy < gridHeight; ++iy) {
     for (size_t ix = 0; ix < gridWidth; ++ix) {
-      setFields(ix, iy, fluid, (int)cell_type::FLUID);
+      flags[cell(ix, iy)] = (int)cell_type::FLUID;
     }
   }
 
   for (size_t iy = 0; iy < gridHeight; ++iy) {
-    setFields(0, iy, source, (int)cell_type::SOURCE);
-    setFields(gridWidth - 1, iy, drain, (int)cell_type::COPY);
+    flags[cell(0, iy)] = (int)cell_type::SOURCE;
+    flags[cell(gridWidth - 1, iy)] = (int)cell_type::COPY;
   }
 
   for (size_t ix = 0; ix < gridWidth; ++ix) {
-    setFields(ix, 0, fluid, (int)cell_type::NO_SLIP);
-    setFields(ix, gridHeight - 1, fluid, (int)cell_type::NO_SLIP);
+    flags[cell(ix, 0)] = (int)cell_type::NO_SLIP;
+    flags[cell(ix, gridHeight - 1)] = (int)cell_type::NO_SLIP;
   }
 
   if (image.size() > 0) {
     for (size_t iy = 0; iy < gridHeight; ++iy) {
       for (size_t ix = 0; ix < gridWidth; ++ix) {
         if (image[iy * gridWidth + ix] != 0) {
-          setFields(ix, iy, fluid, (int)cell_type::NO_SLIP);
+          flags[cell(ix, iy)] = (int)cell_type::NO_SLIP;
         }
       }
     }
   }
 
-  for (size_t i = 0; i < 9; i++) {
-    dst[i]->copyToDevice();
-    src[i]->copyToDevice();
+  for (Slab& slab : slabs) {
+    upload_fields(slab);
+    specialize(slab);
+    update_links(slab, 0, 0, gridWidth, slab.height);
   }
-
-  flag_field->copyToDevice();
+  if (hybrid) {
+    host_src = initial_fields(0, gridHeight);
+    host_dst.clear();
+    if (streaming == streaming_t::TWO_GRID) host_dst = host_src;
+    host_links.resize(pitch * gridHeight);
+    compute_links(flags.data(), gridWidth, gridHeight, pitch, 0, gridHeight,
+                  host_links.data());
+  }
+  update_tiles();
 }
 
+// The stroke is applied twice: to the host copy of the flags, which
+// update_tiles() reads, and by drawMask to the flags and populations on the
+// device, on every slab holding a row of it. Neither the populations nor
+// the flags travel between host and device, only the mask does when it
+// differs from the previous stroke's. A hybrid simulation applies it to
+// the host's populations and links as well.
 void BGK_OCL::do_draw(int x, int y, shared_ptr<const Grid<mask_t>> mask_ptr,
                       cell_t type) {
-  int cx = x;
-  int cy = y;
-
-  for (size_t i = 0; i < 9; i++) {
-    if (!dst[i]->isOnHost()) dst[i]->copyToHost();
-    if (!src[i]->isOnHost()) src[i]->copyToHost();
-  }
-  if (!flag_field->isOnHost()) flag_field->copyToHost();
+  if (type != cell_t::OBSTACLE && type != cell_t::FLUID) return;
+  const int to_obstacle = type == cell_t::OBSTACLE;
+  const int from = (int)(to_obstacle ? cell_type::FLUID : cell_type::NO_SLIP);
+  const int to = (int)(to_obstacle ? cell_type::NO_SLIP : cell_type::FLUID);
 
   const Grid<mask_t>& mask = *(mask_ptr);
 
-  int upper_left_x = cx - (mask.x() / 2);
-  int upper_left_y = cy - (mask.y() / 2);
+  const int upper_left_x = x - (mask.x() / 2);
+  const int upper_left_y = y - (mask.y() / 2);
+  bool changed = false;
   for (size_t iy = 0; iy < mask.y(); ++iy) {
     for (size_t ix = 0; ix < mask.x(); ++ix) {
       int sx = upper_left_x + ix;
@@ -213,79 +1354,185 @@ void BGK_OCL::do_draw(int x, int y, shared_ptr<const Grid<mask_t>> mask_ptr,
         continue;
 
       if (mask_t::IGNORE == mask(ix, iy)) continue;
-      if (type == cell_t::OBSTACLE &&
-          (*flag_field)[sy * gridWidth + sx] == (int)cell_type::FLUID) {
-        setFields(sx, sy, fluid, (int)cell_type::NO_SLIP);
-      }
-      if (type == cell_t::FLUID &&
-          (*flag_field)[sy * gridWidth + sx] == (int)cell_type::NO_SLIP) {
-        setFields(sx, sy, fluid, (int)cell_type::FLUID);
+      int& flag = flags[cell(sx, sy)];
+      if (flag != from) continue;
+      flag = to;
+      changed = true;
+      if (!hybrid) continue;
+      for (std::vector<float>* grid : {&host_src, &host_dst}) {
+        if (grid->empty()) continue;
+        for (size_t i = 0; i < 9; i++) {
+          (*grid)[i * pitch * gridHeight + cell(sx, sy)] = fluid[i];
+        }
       }
     }
   }
-  for (size_t i = 0; i < 9; i++) {
-    dst[i]->copyToDevice();
-    src[i]->copyToDevice();
+  if (!changed) return;
+  if (hybrid) {
+    const int begin = max(upper_left_y - 1, 0);
+    const int end = min(upper_left_y + (int)mask.y() + 1, (int)gridHeight);
+    if (begin < end) {
+      compute_links(flags.data(), gridWidth, gridHeight, pitch, begin, end,
+                    host_links.data());
+    }
   }
-  flag_field->copyToDevice();
-}
 
-auto BGK_OCL::get_velocity_grid() -> Grid<Vec2D<float>> * {
-  if (getVelocityKernel == NULL) return NULL;
+  upload_mask(mask_ptr);
+  const int grid_width = gridWidth;
+  const int grid_pitch = pitch;
+  const int mask_width = mask.x();
+  const int mask_height = mask.y();
+  for (Slab& slab : slabs) {
+    const int grid_height = slab.height;
+    const int top = upper_left_y - (int)slab.top;
+    if (top >= grid_height || top + mask_height <= 0) continue;
 
-  for (size_t i = 0; i < 9; i++) {
-    getVelocityKernel->input(src[i]);
+    cl_uint n = 0;
+    set_arg(slab.draw_kernel, n, sizeof(int), &grid_width);
+    set_arg(slab.draw_kernel, n, sizeof(int), &grid_height);
+    set_arg(slab.draw_kernel, n, sizeof(int), &grid_pitch);
+    set_arg(slab.draw_kernel, n, sizeof(int), &upper_left_x);
+    set_arg(slab.draw_kernel, n, sizeof(int), &top);
+    set_arg(slab.draw_kernel, n, sizeof(int), &mask_width);
+    set_arg(slab.draw_kernel, n, sizeof(int), &mask_height);
+    set_arg(slab.draw_kernel, n, sizeof(cl_mem), &slab.mask_buffer);
+    set_arg(slab.draw_kernel, n, sizeof(int), &to_obstacle);
+    set_arg(slab.draw_kernel, n, sizeof(cl_mem), &slab.src);
+    set_arg(slab.draw_kernel, n, sizeof(cl_mem),
+            slab.dst != NULL ? &slab.dst : &slab.src);
+    set_arg(slab.draw_kernel, n, sizeof(cl_mem), &slab.flags);
+
+    const size_t draw_size[2] = {mask.x(), mask.y()};
+    enqueue(slab, slab.draw_kernel, draw_size, NULL, NULL);
+    // the links of the cells around the stroke change, too
+    update_links(slab, upper_left_x - 1, top - 1, mask.x() + 2,
+                 mask.y() + 2);
   }
+  update_tiles();
+}
 
-  getVelocityKernel->output(vel.size(), vel.data());
-  getVelocityKernel->input((int)gridWidth);
-  getVelocityKernel->input((int)gridHeight);
+// The GUI keeps drawing with the same mask, so it is only uploaded when it
+// changes. Holding on to the shared_ptr keeps the address from being reused
+// by another mask. Each slab gets a copy of its own, written in order with
+// the strokes on its queue.
+void BGK_OCL::upload_mask(shared_ptr<const Grid<mask_t>> mask_ptr) {
+  if (mask_ptr == drawn_mask) return;
+  const Grid<mask_t>& mask = *(mask_ptr);
+  const size_t size = mask.x() * mask.y();
 
-  getVelocityKernel->run(2, global_size, local_size);
+  std::vector<cl_uchar> modify(size);
+  for (size_t iy = 0; iy < mask.y(); ++iy) {
+    for (size_t ix = 0; ix < mask.x(); ++ix) {
+      modify[iy * mask.x() + ix] = mask(ix, iy) == mask_t::MODIFY;
+    }
+  }
 
-  Grid<Vec2D<float>>* g(new Grid<Vec2D<float>>(gridWidth, gridHeight));
-  for (size_t iy = 0; iy < gridHeight; ++iy) {
-    for (size_t ix = 0; ix < gridWidth; ++ix) {
-      (*g)(ix, iy) = Vec2D<float>{vel[iy * gridWidth * 2 + ix * 2],
-                                  vel[iy * gridWidth * 2 + ix * 2 + 1]};
+  cl_int error;
+  for (Slab& slab : slabs) {
+    if (size > slab.mask_capacity) {
+      if (slab.mask_buffer != NULL) clReleaseMemObject(slab.mask_buffer);
+      slab.mask_buffer =
+          clCreateBuffer(context, CL_MEM_READ_ONLY, size, NULL, &error);
+      check(error, "clCreateBuffer");
+      slab.mask_capacity = size;
     }
+    error = clEnqueueWriteBuffer(slab.queue, slab.mask_buffer, CL_TRUE, 0,
+                                 size, modify.data(), 0, NULL, NULL);
+    check(error, "clEnqueueWriteBuffer");
   }
-  return g;
+  drawn_mask = mask_ptr;
 }
 
-auto BGK_OCL::get_density_grid() -> Grid<float> * {
-  if (getDensityKernel == NULL) return NULL;
+// Velocity and density together come from getFields, with one kernel and
+// one read per slab, and are split up while copying them out of the pinned
+// memory. The rows of a hybrid simulation's host are computed here, as the
+// kernels would, and the types come from the host's copy of the flags.
+void BGK_OCL::get_fields(Grid<Vec2D<float>>* velocity, Grid<float>* density,
+                         Grid<cell_t>* types) {
+  if (moments_field.host == NULL) return;
+  static_assert(sizeof(Vec2D<float>) == 2 * sizeof(float),
+                "getVelocity writes x and y interleaved");
 
-  for (size_t i = 0; i < 9; i++) {
-    getDensityKernel->input(src[i]);
+  const size_t device_rows = hybrid ? host_first : gridHeight;
+  if (velocity != NULL && density != NULL) {
+    download(moments_field, NULL);
+    const float* m = static_cast<const float*>(moments_field.host);
+    Vec2D<float>* v = velocity->data();
+    float* rho = density->data();
+    for (size_t i = 0; i < gridWidth * device_rows; i++) {
+      v[i] = Vec2D<float>(m[3 * i], m[3 * i + 1]);
+      rho[i] = m[3 * i + 2];
+    }
+  } else if (velocity != NULL) {
+    download(velocity_field, velocity->data());
+  } else if (density != NULL) {
+    download(density_field, density->data());
   }
 
-  getDensityKernel->output(density.size(), density.data());
-  getDensityKernel->input((int)gridWidth);
-  getDensityKernel->input((int)gridHeight);
-
-  getDensityKernel->run(2, global_size, local_size);
-
-  Grid<float>* g(new Grid<float>(gridWidth, gridHeight));
-  for (size_t iy = 0; iy < gridHeight; ++iy) {
-    for (size_t ix = 0; ix < gridWidth; ++ix) {
-      (*g)(ix, iy) = density[iy * gridWidth + ix];
+  if (velocity != NULL || density != NULL) {
+    const float* f = host_src.data();
+    const size_t plane = pitch * gridHeight;
+    for (size_t iy = device_rows; iy < gridHeight; ++iy) {
+      for (size_t ix = 0; ix < gridWidth; ++ix) {
+        const size_t c = cell(ix, iy);
+        if (velocity != NULL) {
+          (*velocity)(ix, iy) = Vec2D<float>(
+              f[NE * plane + c] - f[NW * plane + c] + f[E * plane + c] -
+                  f[W * plane + c] + f[SE * plane + c] - f[SW * plane + c],
+              f[SW * plane + c] - f[NW * plane + c] + f[S * plane + c] -
+                  f[N * plane + c] + f[SE * plane + c] - f[NE * plane + c]);
+        }
+        if (density != NULL) {
+          float rho = 0.0f;
+          for (size_t i = 0; i < 9; i++) {
+            rho += f[i * plane + c];
+          }
+          (*density)(ix, iy) = rho;
+        }
+      }
     }
   }
-  return g;
-}
 
-auto BGK_OCL::get_type_grid() -> Grid<cell_t> * {
-  Grid<cell_t>* g(new Grid<cell_t>(gridWidth, gridHeight));
-  for (size_t iy = 0; iy < gridHeight; ++iy) {
-    for (size_t ix = 0; ix < gridWidth; ++ix) {
-      (*g)(ix, iy) = cell_t::FLUID;
+  if (types != NULL) {
+    for (size_t iy = 0; iy < gridHeight; ++iy) {
+      for (size_t ix = 0; ix < gridWidth; ++ix) {
+        const int flag = flags[cell(ix, iy)];
+        (*types)(ix, iy) = flag == (int)cell_type::NO_SLIP ? cell_t::OBSTACLE
+                           : flag == (int)cell_type::FLUID ? cell_t::FLUID
+                                                           : cell_t::CONSTANT;
+      }
     }
   }
-  return g;
 }
 
 void BGK_OCL::write_data(std::ostream& dest) {}
 
 void BGK_OCL::read_data(std::istream& src) {}
+
+void BGK_OCL::do_streaming(streaming_t mode) {
+  if (mode == streaming) return;
+  streaming = mode;
+  // before init() only the mode is recorded
+  if (slabs.empty()) return;
+  sync();
+  host_dst.clear();
+  if (hybrid && mode == streaming_t::TWO_GRID) host_dst = host_src;
+
+  cl_int error;
+  for (Slab& slab : slabs) {
+    slab.step_kernels_bound = false;
+    if (mode == streaming_t::IN_PLACE) {
+      clReleaseMemObject(slab.dst);
+      slab.dst = NULL;
+      continue;
+    }
+    slab.dst = clCreateBuffer(context, CL_MEM_READ_WRITE,
+                              sizeof(float) * 9 * plane(slab), NULL, &error);
+    check(error, "clCreateBuffer");
+    check(clEnqueueCopyBuffer(
+        slab.queue, slab.src, slab.dst, 0, 0, sizeof(float) * 9 * plane(slab),
+        0, NULL, NULL),
+          "clEnqueueCopyBuffer");
+  }
+}
 }
@@ -16,7 +16,19 @@ You should have received a copy of the GNU Affero General Public License along
 with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include "core/MRT_LBM.hpp"
+#include "core/SIMD.hpp"
 #include <sys/time.h>
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <string>
+#include <tuple>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 using namespace std;
 
@@ -51,310 +63,850 @@ namespace Feldrand {
 			cell_t::OBSTACLE
 		};
 
+		/* the population planes, in the same order as the members of Cell.
+		 * The direction opposite to i is always 8 - i. */
+		enum dir : size_t { NW, N, NE, W, C, E, SW, S, SE };
 
+		const uint8_t fluid_flag = (uint8_t)cell_t::FLUID;
+		const uint8_t obstacle_flag = (uint8_t)cell_t::OBSTACLE;
+
+		const size_t default_block_height = 16;
+		const size_t default_temporal_depth = 4;
+
+		/* edge length of the tiles in active_tiles, a multiple of every
+		 * P::width */
+		const size_t tile_size = 32;
+
+		/* the relaxation rate of the shear stresses */
+		const float omega = 1.8f;
+
+		/* The relaxation rate of the shear stresses, which is lowered at
+		 * high velocities to keep the simulation stable. */
+		template<typename P>
+		inline P shear_rate(P vSquared) {
+			return select(vSquared > P(0.05f),
+						  P(0.00025f) / vSquared / vSquared, P(omega));
+		}
+
+		/* applied to the populations after every collision */
+		template<typename P>
+		inline void clamp(P f[9]) {
+			const P zero = 0.0f;
+			const P limit = 10.0e5f;
+			for(size_t i = 0; i < 9; ++i) {
+				f[i] = select(f[i] < zero, zero, f[i]);
+				/* stability workaround */
+				f[i] = select(f[i] > limit, f[i] * P(0.5f), f[i]);
+			}
+		}
+
+		/* The incompressible equilibrium of the populations i and 8 - i,
+		 * for i < 4, split into its symmetric part and the antisymmetric
+		 * part of population i. ej is the momentum along direction i. */
+		template<typename P>
+		inline void equilibrium(size_t i, P rho, P ej, P jSquared,
+								P& symmetric, P& antisymmetric) {
+			const P w = (N == i || W == i) ? 1.0f / 9.0f : 1.0f / 36.0f;
+			symmetric = w * (rho + P(4.5f) * ej * ej - P(1.5f) * jSquared);
+			antisymmetric = w * P(3.0f) * ej;
+		}
+
+		/* the momentum of the cells along NW, N, NE and W */
+		template<typename P>
+		inline void momentum(const P f[9], P& rho, P ej[4], P& jSquared) {
+			rho =        f[NW] + f[N] + f[NE]
+				+        f[W]  + f[C] + f[E]
+				+        f[SW] + f[S] + f[SE];
+			const P jx = - f[NW] + f[NE] - f[W] + f[E] - f[SW] + f[SE];
+			const P jy =   f[NW] + f[N] + f[NE] - f[SW] - f[S] - f[SE];
+			ej[NW] = jy - jx;
+			ej[N]  = jy;
+			ej[NE] = jy + jx;
+			ej[W]  = -jx;
+			jSquared = jx * jx + jy * jy;
+		}
+
+		/* offset of the neighbor each population is pulled from, the
+		 * populations themselves move by -dx, -dy */
+		const int dx[9] = { +1,  0, -1, +1,  0, -1, +1,  0, -1 };
+		const int dy[9] = { +1, +1, +1,  0,  0,  0, -1, -1, -1 };
+
+		/* The CPUs the process may run on, as found before any thread was
+		 * pinned. */
+		const vector<int>& available_cpus() {
+			static vector<int> cpus;
+#ifdef __linux__
+			if(!cpus.empty()) return cpus;
+			cpu_set_t set;
+			if(0 != sched_getaffinity(0, sizeof(set), &set)) return cpus;
+			for(int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+				if(CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+			}
+#endif
+			return cpus;
+		}
+
+		/* a value from the sysfs topology of cpu, -1 if unknown */
+		int topology(int cpu, const char* name) {
+			ifstream file("/sys/devices/system/cpu/cpu" + to_string(cpu)
+						  + "/topology/" + name);
+			int value = -1;
+			if(!(file >> value)) return -1;
+			return value;
+		}
+
+		/* The available CPUs of each package (socket), in the order
+		 * SCATTER uses them: one hardware thread of every core first, then
+		 * the second ones, and so on. Empty if the topology is unknown. */
+		const vector<vector<int>>& packages() {
+			static vector<vector<int>> result;
+			if(!result.empty()) return result;
+			// package -> (hardware thread of the core, core, cpu)
+			map<int, vector<tuple<int, int, int>>> found;
+			map<pair<int, int>, int> threads_of_core;
+			for(int cpu : available_cpus()) {
+				const int package = topology(cpu, "physical_package_id");
+				const int core = topology(cpu, "core_id");
+				if(package < 0 || core < 0) return result;
+				const int thread = threads_of_core[make_pair(package, core)]++;
+				found[package].push_back(make_tuple(thread, core, cpu));
+			}
+			for(auto& package : found) {
+				sort(package.second.begin(), package.second.end());
+				result.emplace_back();
+				for(const auto& cpu : package.second) {
+					result.back().push_back(get<2>(cpu));
+				}
+			}
+			return result;
+		}
+
+		/* Pins the calling thread, number thread of threads, according to
+		 * affinity. SCATTER gives each package an equal share of the
+		 * threads, in order, since neighboring threads update neighboring
+		 * rows, and puts the threads of a package on distinct cores as
+		 * long as there are enough. */
+		void pin(size_t thread, size_t threads, affinity_t affinity) {
+#ifdef __linux__
+			const vector<int>& cpus = available_cpus();
+			if(cpus.empty()) return;
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			switch(affinity) {
+			case affinity_t::COMPACT:
+				CPU_SET(cpus[thread % cpus.size()], &set);
+				break;
+			case affinity_t::SCATTER: {
+				const vector<vector<int>>& by_package = packages();
+				if(by_package.empty()) {
+					CPU_SET(cpus[(thread * cpus.size() / threads) % cpus.size()],
+							&set);
+					break;
+				}
+				const size_t n = by_package.size();
+				const size_t package = thread * n / threads;
+				// the first thread that goes to package
+				const size_t first = (package * threads + n - 1) / n;
+				const vector<int>& own = by_package[package];
+				CPU_SET(own[(thread - first) % own.size()], &set);
+				break;
+			}
+			default:
+				for(int cpu : cpus) CPU_SET(cpu, &set);
+				break;
+			}
+			sched_setaffinity(0, sizeof(set), &set);
+#endif
+		}
+
+		/* The lanes of row y, starting at column x, that are updated by a
+		 * timestep: fluid cells which are not part of the outermost rows
+		 * and columns. Everything else keeps its populations. */
+		template<typename P>
+		inline typename P::Mask updated(const PlaneGrid<uint8_t, 1>& flags,
+										ptrdiff_t x, ptrdiff_t y) {
+			const ptrdiff_t w = flags.x();
+			typename P::Mask m = P::match(flags.row(0, y) + x, fluid_flag);
+			if(x < 1 || x + (ptrdiff_t)P::width >= w) {
+				m = m & P::range(x, 1, w - 1);
+			}
+			return m;
+		}
 	}
 
-	MRT_LBM::MRT_LBM()
+	/* BGK collision of P::width cells at once. All populations relax
+	 * towards equilibrium with the shear rate. */
+	struct BGK {
+		template<typename P>
+		static inline void collide(P f[9]) {
+			P rho, ej[4], jSquared;
+			momentum(f, rho, ej, jSquared);
+			const P omega = shear_rate(jSquared);
+			for(size_t i = 0; i < 4; ++i) {
+				P symmetric, antisymmetric;
+				equilibrium(i, rho, ej[i], jSquared, symmetric, antisymmetric);
+				f[i] = f[i] - omega * (f[i] - (symmetric + antisymmetric));
+				f[8 - i] = f[8 - i]
+					- omega * (f[8 - i] - (symmetric - antisymmetric));
+			}
+			const P center = 4.0f / 9.0f;
+			f[C] = f[C] - omega * (f[C] - center * (rho - P(1.5f) * jSquared));
+			clamp(f);
+		}
+	};
+
+	/* TRT collision of P::width cells at once. The symmetric parts of
+	 * opposite populations relax with the shear rate, the antisymmetric
+	 * parts with the rate that keeps the "magic" product of both
+	 * relaxation times at 3/16, which places the no-slip walls exactly
+	 * halfway between the cells. */
+	struct TRT {
+		template<typename P>
+		static inline void collide(P f[9]) {
+			P rho, ej[4], jSquared;
+			momentum(f, rho, ej, jSquared);
+			const P half = 0.5f;
+			const P one = 1.0f;
+			const P plus = shear_rate(jSquared);
+			/* 1 / minus - 1/2 = (3/16) / (1 / plus - 1/2) */
+			const P excess = one / plus - half;
+			const P minus = excess / (P(3.0f / 16.0f) + half * excess);
+			for(size_t i = 0; i < 4; ++i) {
+				P symmetric, antisymmetric;
+				equilibrium(i, rho, ej[i], jSquared, symmetric, antisymmetric);
+				const P even = plus * (half * (f[i] + f[8 - i]) - symmetric);
+				const P odd = minus * (half * (f[i] - f[8 - i]) - antisymmetric);
+				f[i] = f[i] - even - odd;
+				f[8 - i] = f[8 - i] - even + odd;
+			}
+			const P center = 4.0f / 9.0f;
+			f[C] = f[C] - plus * (f[C] - center * (rho - P(1.5f) * jSquared));
+			clamp(f);
+		}
+	};
+
+	/* MRT collision of P::width cells at once. The moments of each cell
+	 * are calculated and individually relaxed towards equilibrium. */
+	struct MRT {
+		template<typename P>
+		static inline void collide(P f[9]) {
+			const P p1 = 1.63f;
+			const P p2 = 1.14f;
+			const P p4 = 1.9f;
+			const P p6 = 1.92f;
+			const P two = 2.0f;
+			const P three = 3.0f;
+			const P four = 4.0f;
+
+			// calculation of the moments
+			P m0; // the density
+			P m1; // the energy
+			P m2; // energy squared
+			P m3; // momentum x
+			P m4; // heatflow x
+			P m5; // momentum y
+			P m6; // heatflow y
+			P m7; // diagonal stress
+			P m8; // off-diagonal stress
+			m0 =         f[NW] +       f[N] +       f[NE]
+				+       f[W]  +       f[C] +       f[E]
+				+       f[SW] +       f[S] +       f[SE];
+
+			m1 =   two * f[NW] -       f[N] + two * f[NE]
+				-       f[W]  - four * f[C] -      f[E]
+				+ two * f[SW] -       f[S] + two * f[SE];
+
+			m2 =         f[NW] - two * f[N] +       f[NE]
+				- two * f[W]  + four * f[C] - two * f[E]
+				+       f[SW] - two * f[S] +       f[SE];
+
+			m3 = -       f[NW] +       f[NE]
+				-       f[W]  +       f[E]
+				-       f[SW] +       f[SE];
+
+			m4 = -       f[NW] +       f[NE]
+				+ two * f[W]  - two * f[E]
+				-       f[SW] +       f[SE];
+
+			m5 =         f[NW] +       f[N] +       f[NE]
+				-       f[SW] -       f[S] -       f[SE];
+
+			m6 =         f[NW] - two * f[N] +       f[NE]
+				-       f[SW] + two * f[S] -       f[SE];
+
+			m7 = -       f[N]
+				+       f[W]  +       f[E]
+				-       f[S];
+
+			m8 = -       f[NW] +       f[NE]
+				+       f[SW] -       f[SE];
+
+			P vSquared = m3 * m3 + m5 * m5;
+
+			P p7 = shear_rate(vSquared);
+			P p8 = p7;
+
+			// moment relaxation
+			m1 = m1 - p1 * (m1 + (two * m0 - three * vSquared));
+			m2 = m2 - p2 * (m2 - (m0 - three * vSquared));
+			m4 = m4 - p4 * (m4 + m3);
+			m6 = m6 - p6 * (m6 + m5);
+			m7 = m7 - p7 * (m7 - (m3 * m3 - m5 * m5));
+			m8 = m8 - p8 * (m8 - m3 * m5);
+
+			// back transformation of the moments
+			m0 = four * m0;
+			m3 = P(6.0f) * m3;
+			m4 = three * m4;
+			m5 = P(6.0f) * m5;
+			m6 = three * m6;
+			m7 = P(9.0f) * m7;
+			m8 = P(9.0f) * m8;
+			const P r = 1.0f / 36.0f;
+			f[NW] = (m0 +two*m1 +    m2 -m3 -    m4 +m5 +    m6     -m8) * r;
+			f[N]  = (m0 -    m1 -two*m2             +m5 -two*m6 -m7    ) * r;
+			f[NE] = (m0 +two*m1 +    m2 +m3 +    m4 +m5 +    m6     +m8) * r;
+			f[W]  = (m0 -    m1 -two*m2 -m3 +two*m4             +m7    ) * r;
+			f[C]  = (m0 -four*m1 +four*m2                             ) * r;
+			f[E]  = (m0 -    m1 -two*m2 +m3 -two*m4             +m7    ) * r;
+			f[SW] = (m0 +two*m1 +    m2 -m3 -    m4 -m5 -    m6     +m8) * r;
+			f[S]  = (m0 -    m1 -two*m2             -m5 +two*m6 -m7    ) * r;
+			f[SE] = (m0 +two*m1 +    m2 +m3 +    m4 -m5 -    m6     -m8) * r;
+
+			clamp(f);
+		}
+	};
+
+	template<typename Collision, typename Real>
+	CPU_LBM<Collision, Real>::CPU_LBM()
 		: SimulationImplementation(0.0, 0.0, 0, 0),
 		  src(gridWidth, gridHeight),
-		  dest(gridWidth, gridHeight)
+		  dest(gridWidth, gridHeight),
+		  flags(gridWidth, gridHeight),
+		  tiles_x(0),
+		  streaming(streaming_t::TWO_GRID),
+		  block_height(default_block_height),
+		  temporal_depth(default_temporal_depth)
 	{}
 
-	MRT_LBM::MRT_LBM (double width, double height,
+	template<typename Collision, typename Real>
+	CPU_LBM<Collision, Real>::CPU_LBM(double width, double height,
 					   size_t grid_width, size_t grid_height)
 		: SimulationImplementation(width, height, grid_width, grid_height),
 		  src(gridWidth, gridHeight),
-		  dest(gridWidth, gridHeight)
-	{
-		do_clear();
-	}
+		  dest(gridWidth, gridHeight),
+		  flags(gridWidth, gridHeight),
+		  tiles_x(0),
+		  streaming(streaming_t::TWO_GRID),
+		  block_height(default_block_height),
+		  temporal_depth(default_temporal_depth)
+	{}
 
-	MRT_LBM::MRT_LBM(MRT_LBM& other)
+	template<typename Collision, typename Real>
+	CPU_LBM<Collision, Real>::CPU_LBM(CPU_LBM& other)
 		: SimulationImplementation(other),
 		  src(gridWidth, gridHeight),
-		  dest(gridWidth, gridHeight)
+		  dest(gridWidth, gridHeight),
+		  flags(gridWidth, gridHeight),
+		  tiles_x(0),
+		  streaming(streaming_t::TWO_GRID),
+		  block_height(default_block_height),
+		  temporal_depth(default_temporal_depth)
 	{
 		// TODO copy data
 	}
 
-	MRT_LBM::~MRT_LBM() {}
+	template<typename Collision, typename Real>
+	CPU_LBM<Collision, Real>::~CPU_LBM() {}
 
-	// nuthin', doesnt need it.
-	void MRT_LBM::init() {
+	/* The grids are cleared here on the work thread, not by the
+	 * constructor, so that they are first written by the OpenMP team that
+	 * updates them. */
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::init() {
+		if(0 != gridWidth && 0 != gridHeight) do_clear();
 	}
 
+	/* In place, a call performs two timesteps, so that the populations are
+	 * back in their natural order whenever requests are handled. */
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::one_iteration() {
+		if(streaming_t::IN_PLACE == streaming) {
+			aa_even_step();
+			aa_odd_step();
+		} else {
+			stream_collide(src, dest, 1, gridHeight - 1);
+			PlaneGrid<Real, 9>::swap(src, dest);
+		}
+	}
 
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::iterate(size_t steps) {
+		if(streaming_t::IN_PLACE == streaming || temporal_depth < 2) {
+			SimulationImplementation::iterate(steps);
+			return;
+		}
+		for(size_t done = 0; done < steps; done += temporal_depth) {
+			wavefront(min(temporal_depth, steps - done));
+		}
+	}
+
+	/* The block height decides which thread updates which row, so the
+	 * grids are placed anew. */
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::do_blocking(size_t block_height, size_t temporal_depth) {
+		block_height = max(block_height, (size_t)1);
+		temporal_depth = max(temporal_depth, (size_t)1);
+		if(block_height == this->block_height &&
+		   temporal_depth == this->temporal_depth) return;
+		this->block_height = block_height;
+		this->temporal_depth = temporal_depth;
+		place_grids();
+	}
+
+	/* OpenMP reuses its threads from one parallel region to the next, so
+	 * they are pinned once here. Afterwards the grids are placed anew,
+	 * which moves their pages to the NUMA nodes of the threads that update
+	 * them. */
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::do_threads(size_t count, affinity_t affinity) {
+#ifdef _OPENMP
+		available_cpus();
+		packages();
+		if(0 == count) count = omp_get_num_procs();
+		omp_set_num_threads(count);
+#pragma omp parallel
+		pin(omp_get_thread_num(), omp_get_num_threads(), affinity);
+		place_grids();
+#endif
+	}
+
+	/* Mirrors the row loops of iterate(): the wavefront splits each block
+	 * of block_height rows among the threads, the other sweeps split all
+	 * rows at once. Each timestep of the wavefront runs a row behind the
+	 * previous one, so the rows follow the split of the first. The rows
+	 * that are never updated go with their neighbors. */
+	template<typename Collision, typename Real>
+	template<typename Touch>
+	void CPU_LBM<Collision, Real>::for_each_row(Touch touch) {
+		if(gridHeight < 3) {
+			for(ptrdiff_t y = -1; y <= (ptrdiff_t)gridHeight; ++y) touch(y);
+			return;
+		}
+		const bool blocked = streaming_t::TWO_GRID == streaming
+			&& temporal_depth >= 2;
+		const size_t height = blocked ? block_height : gridHeight;
+		for(size_t first = 1; first < gridHeight - 1; first += height) {
+			const size_t last = min(first + height, gridHeight - 1);
+#pragma omp parallel for schedule(static)
+			for(size_t iy = first; iy < last; ++iy) {
+				if(1 == iy) {
+					touch(-1);
+					touch(0);
+				}
+				touch(iy);
+				if(gridHeight - 2 == iy) {
+					touch(gridHeight - 1);
+					touch(gridHeight);
+				}
+			}
+		}
+	}
 
-	void MRT_LBM::one_iteration() {
-			collide();
-			stream();
-			Grid<Cell>::swap(src, dest);
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::place_grids() {
+		const bool two_grid = streaming_t::TWO_GRID == streaming;
+		PlaneGrid<Real, 9> placed_src(gridWidth, gridHeight);
+		PlaneGrid<Real, 9> placed_dest;
+		if(two_grid) placed_dest = PlaneGrid<Real, 9>(gridWidth, gridHeight);
+		PlaneGrid<uint8_t, 1> placed_flags(gridWidth, gridHeight);
+		for_each_row([&](ptrdiff_t y) {
+			placed_src.copy_row(src, y);
+			if(two_grid) placed_dest.copy_row(dest, y);
+			placed_flags.copy_row(flags, y);
+		});
+		src = std::move(placed_src);
+		dest = std::move(placed_dest);
+		flags = std::move(placed_flags);
+	}
 
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::set_cell(size_t x, size_t y, const Cell& cell) {
+		const float* values = &cell.NW;
+		for(size_t i = 0; i < 9; ++i) {
+			src(i, x, y) = values[i];
+			if(streaming_t::TWO_GRID == streaming) dest(i, x, y) = values[i];
+		}
+		flags(0, x, y) = (uint8_t)cell.type;
 	}
 
-		void MRT_LBM::do_clear() {
-			for(size_t iy = 0; iy < src.y(); ++iy) {
-				for(size_t ix = 0; ix < src.x(); ++ix) {
-					src(ix, iy) = fluid;
-					dest(ix, iy) = fluid;
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::update_links() {
+		no_slip_links.clear();
+		passive_links.clear();
+		no_slip_rows.assign(gridHeight + 1, 0);
+		tiles_x = (src.pitch() + tile_size - 1) / tile_size;
+		active_tiles.assign(tiles_x * ((gridHeight + tile_size - 1) / tile_size),
+							0);
+		for(size_t iy = 1; iy < gridHeight - 1; ++iy) {
+			no_slip_rows[iy] = no_slip_links.size();
+			for(size_t ix = 1; ix < gridWidth - 1; ++ix) {
+				if(fluid_flag != flags(0, ix, iy)) continue;
+				active_tiles[tile(ix, iy)] = 1;
+				for(size_t i = 0; i < 9; ++i) {
+					const size_t zx = ix + dx[i];
+					const size_t zy = iy + dy[i];
+					const Link link = { src.index(i, zx, zy),
+										src.index(8 - i, ix, iy),
+										src(i, zx, zy) };
+					if(obstacle_flag == flags(0, zx, zy)) {
+						no_slip_links.push_back(link);
+					} else if(fluid_flag != flags(0, zx, zy)
+							  || zx == 0 || zx == gridWidth - 1
+							  || zy == 0 || zy == gridHeight - 1) {
+						passive_links.push_back(link);
+					}
 				}
 			}
-			// TODO remove this fun hack that makes clear initialize a wind tunnel
-			for(size_t iy = 0; iy < src.y(); ++iy) {
-				size_t ix = 0;
-				src(ix, iy) = source;
-				dest(ix, iy) = source;
+		}
+		for(size_t iy = gridHeight - 1; iy <= gridHeight; ++iy) {
+			no_slip_rows[iy] = no_slip_links.size();
+		}
+		/* the sweeps no longer copy the inactive tiles from src to dest,
+		 * so both grids must agree on them from now on */
+		if(streaming_t::IN_PLACE == streaming) return;
+		for(size_t iy = 0; iy < gridHeight; ++iy) {
+			for(size_t ix = 0; ix < src.pitch(); ix += tile_size) {
+				if(active_tiles[tile(ix, iy)]) continue;
+				const size_t end = min(ix + tile_size, src.pitch());
+				for(size_t i = 0; i < 9; ++i) {
+					copy(src.row(i, iy) + ix, src.row(i, iy) + end,
+						 dest.row(i, iy) + ix);
+				}
 			}
-			for(size_t iy = 0; iy < src.y(); ++iy) {
-				size_t ix = gridWidth - 1;
-				src(ix, iy) = drain;
-				dest(ix, iy) = drain;
+		}
+	}
+
+	template<typename Collision, typename Real>
+	size_t CPU_LBM<Collision, Real>::tile(size_t x, size_t y) const {
+		return (y / tile_size) * tiles_x + x / tile_size;
+	}
+
+	/* The in place sweeps split the rows differently from the wavefront,
+	 * so the grids are placed anew. */
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::do_streaming(streaming_t mode) {
+		if(mode == streaming) return;
+		streaming = mode;
+		if(streaming_t::IN_PLACE == mode) {
+			dest = PlaneGrid<Real, 9>();
+		} else {
+			dest = PlaneGrid<Real, 9>(src);
+		}
+		place_grids();
+	}
+
+	/* All collisions relax the shear stresses with omega, the lowered rate
+	 * at high velocities is left aside. */
+	template<typename Collision, typename Real>
+	auto CPU_LBM<Collision, Real>::lattice_viscosity() -> double {
+		return (1.0 / omega - 0.5) / 3.0;
+	}
+
+	template<typename Collision, typename Real>
+	auto CPU_LBM<Collision, Real>::timesteps_per_iteration() -> size_t {
+		return streaming_t::IN_PLACE == streaming ? 2 : 1;
+	}
+
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::do_clear() {
+		/* the padding never takes part in the simulation, but it is
+		 * processed by the vectorized loops and must therefore hold
+		 * sane values */
+		const bool two_grid = streaming_t::TWO_GRID == streaming;
+		for_each_row([&](ptrdiff_t y) {
+			src.fill_row(y, 0.0f);
+			if(two_grid) dest.fill_row(y, 0.0f);
+			flags.fill_row(y, obstacle_flag);
+		});
+		for(size_t iy = 0; iy < gridHeight; ++iy) {
+			for(size_t ix = 0; ix < gridWidth; ++ix) {
+				set_cell(ix, iy, fluid);
 			}
 		}
+		// TODO remove this fun hack that makes clear initialize a wind tunnel
+		for(size_t iy = 0; iy < gridHeight; ++iy) {
+			set_cell(0, iy, source);
+		}
+		for(size_t iy = 0; iy < gridHeight; ++iy) {
+			set_cell(gridWidth - 1, iy, drain);
+		}
+		update_links();
+	}
 
-		void MRT_LBM::do_draw(int x, int y,
-							  shared_ptr<const Grid<mask_t>> mask_ptr,
-							  cell_t type) {
-			int cx = x;
-			int cy = y;
-			const Grid<mask_t>& mask = *(mask_ptr);
-
-			int upper_left_x = cx - (mask.x() / 2);
-			int upper_left_y = cy - (mask.y() / 2);
-			for(size_t iy = 0; iy < mask.y(); ++iy) {
-				for(size_t ix = 0; ix < mask.x(); ++ix) {
-					int sx = upper_left_x + ix;
-					int sy = upper_left_y + iy;
-					if(sx < 0 || sx >= (int)gridWidth ||
-					   sy < 0 || sy >= (int)gridHeight) continue;
-
-					if(mask_t::IGNORE == mask(ix, iy)) continue;
-					src(sx, sy).type = type; // TODO handle pressure
-					dest(sx, sy).type = type;
-				}
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::do_draw(int x, int y,
+						  shared_ptr<const Grid<mask_t>> mask_ptr,
+						  cell_t type) {
+		int cx = x;
+		int cy = y;
+		const Grid<mask_t>& mask = *(mask_ptr);
+
+		int upper_left_x = cx - (mask.x() / 2);
+		int upper_left_y = cy - (mask.y() / 2);
+		for(size_t iy = 0; iy < mask.y(); ++iy) {
+			for(size_t ix = 0; ix < mask.x(); ++ix) {
+				int sx = upper_left_x + ix;
+				int sy = upper_left_y + iy;
+				if(sx < 0 || sx >= (int)gridWidth ||
+				   sy < 0 || sy >= (int)gridHeight) continue;
+
+				if(mask_t::IGNORE == mask(ix, iy)) continue;
+				flags(0, sx, sy) = (uint8_t)type; // TODO handle pressure
 			}
 		}
-		auto MRT_LBM::get_velocity_grid() -> Grid<Vec2D<float>>* {
-			Grid<Vec2D<float>>* g(new Grid<Vec2D<float>>(gridWidth, gridHeight));
-			for(size_t iy = 0; iy < src.y(); ++iy) {
-				for(size_t ix = 0; ix < src.x(); ++ix) {
-					const Cell& cell = src(ix, iy);
+		update_links();
+	}
+
+	/* One pass over the rows for all requested fields, so that each
+	 * population is loaded once. */
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::get_fields(Grid<Vec2D<float>>* velocity,
+											  Grid<float>* density,
+											  Grid<cell_t>* types) {
+		for(size_t iy = 0; iy < gridHeight; ++iy) {
+			const Real* f[9];
+			for(size_t i = 0; i < 9; ++i) f[i] = src.row(i, iy);
+			for(size_t ix = 0; ix < gridWidth; ++ix) {
+				Real v[9];
+				for(size_t i = 0; i < 9; ++i) v[i] = f[i][ix];
+				if(velocity) {
 					float vx, vy;
-					vx = -       cell.NW +          0.0 +       cell.NE
-						-       cell.W  +          0.0 +       cell.E
-						-       cell.SW +          0.0 +       cell.SE;
+					vx = - v[NW] + v[NE]
+						- v[W]  + v[E]
+						- v[SW] + v[SE];
 
-					vy = -         cell.NW -       cell.N -       cell.NE
-						+           0.0 +          0.0 +           0.0
-						+       cell.SW +       cell.S +       cell.SE;
+					vy = - v[NW] - v[N] - v[NE]
+						+ v[SW] + v[S] + v[SE];
 
-					(*g)(ix, iy) = {vx, vy};
+					(*velocity)(ix, iy) = {vx, vy};
 				}
-			}
-			return g;
-		}
-
-		auto MRT_LBM::get_density_grid()  -> Grid<float>* {
-			Grid<float>* g(new Grid<float>(gridWidth, gridHeight));
-			for(size_t iy = 0; iy < gridHeight; ++iy) {
-				for(size_t ix = 0; ix < gridWidth; ++ix) {
-					const Cell& cell = src(ix, iy);
-					float d =    cell.NW +       cell.N +       cell.NE
-						+ cell.W  +       cell.C +       cell.E
-						+ cell.SW +       cell.S +       cell.SE;
-					(*g)(ix, iy) = d;
+				if(density) {
+					float d = 0.0f;
+					for(size_t i = 0; i < 9; ++i) d += v[i];
+					(*density)(ix, iy) = d;
+				}
+				if(types) {
+					(*types)(ix, iy) = (cell_t)flags(0, ix, iy);
 				}
 			}
-			return g;
 		}
+	}
 
-		auto MRT_LBM::get_type_grid()     -> Grid<cell_t>* {
-			Grid<cell_t>* g(new Grid<cell_t>(gridWidth, gridHeight));
-			for(size_t iy = 0; iy < gridHeight; ++iy) {
-				for(size_t ix = 0; ix < gridWidth; ++ix) {
-					const Cell& cell = src(ix, iy);
-					(*g)(ix, iy) = cell.type;
-				}
+	/* The populations are written cell by cell, in the same format a
+	 * Grid<Cell> would have. */
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::write_data(std::ostream& dest) {
+		dest << gridWidth << "\n" << gridHeight << "\n";
+		for(size_t iy = 0; iy < gridHeight; ++iy) {
+			for(size_t ix = 0; ix < gridWidth; ++ix) {
+				Cell cell;
+				float* values = &cell.NW;
+				for(size_t i = 0; i < 9; ++i) values[i] = src(i, ix, iy);
+				cell.type = (cell_t)flags(0, ix, iy);
+				dest << cell << cell.type << "\n";
 			}
-			return g;
-		}
-
-		void MRT_LBM::write_data(std::ostream& dest) {
-			dest << this->src;
-			dest << this->dest;
-		}
-
-		void MRT_LBM::read_data(std::istream& src) {
-			src >> this->src;
-			src >> this->dest;
-		}
-
-		/* The streaming step of the MRT-LBM simulation. The values of each fluid
-		 * cell are exchanged with their neighbors or reflected should the
-		 * neighbor be an obstacle cell */
-		void MRT_LBM::stream() {
-			/* Instead of reflecting the cells value next to an obstacle, we
-			 * copy the value in the opposite entry of the obstacle cell. Afterwards
-			 * all cells can simply exchange values without any conditionals, the
-			 * net effect is the same. */
-			#pragma omp parallel for
-			for(size_t iy = 1; iy < gridHeight - 1; ++iy) {
-				for(size_t ix = 1; ix < gridWidth - 1; ++ix) {
-					if(src(ix, iy).type != cell_t::FLUID) continue;
-					Cell& NW = src(ix - 1, iy + 1);
-					Cell& N  = src(ix    , iy + 1);
-					Cell& NE = src(ix + 1, iy + 1);
-					Cell& W  = src(ix - 1, iy    );
-					Cell& C  = src(ix    , iy    );
-					Cell& E  = src(ix + 1, iy    );
-					Cell& SW = src(ix - 1, iy - 1);
-					Cell& S  = src(ix    , iy - 1);
-					Cell& SE = src(ix + 1, iy - 1);
-
-					/* noslip boundaries */
-					if(cell_t::OBSTACLE == NW.type) NW.SE = C.NW;
-					if(cell_t::OBSTACLE ==  N.type)  N.S  = C.N;
-					if(cell_t::OBSTACLE == NE.type) NE.SW = C.NE;
-					if(cell_t::OBSTACLE ==  W.type)  W.E  = C.W;
-					if(cell_t::OBSTACLE ==  E.type)  E.W  = C.E;
-					if(cell_t::OBSTACLE == SW.type) SW.NE = C.SW;
-					if(cell_t::OBSTACLE ==  S.type)  S.N  = C.S;
-					if(cell_t::OBSTACLE == SE.type) SE.NW = C.SE;
+		}
+	}
+
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::read_data(std::istream& src) {
+		size_t x, y;
+		src >> x >> y;
+		this->src = PlaneGrid<Real, 9>(x, y);
+		if(streaming_t::TWO_GRID == streaming) {
+			this->dest = PlaneGrid<Real, 9>(x, y);
+		}
+		this->flags = PlaneGrid<uint8_t, 1>(x, y);
+		this->src.fill(0.0f);
+		this->dest.fill(0.0f);
+		this->flags.fill(obstacle_flag);
+		for(size_t iy = 0; iy < y; ++iy) {
+			for(size_t ix = 0; ix < x; ++ix) {
+				Cell cell;
+				src >> cell >> cell.type;
+				set_cell(ix, iy, cell);
+			}
+		}
+		update_links();
+	}
+
+	/* One timestep of the MRT-LBM simulation for the rows first_row to
+	 * last_row - 1, in a single sweep from in to out. Each fluid cell pulls
+	 * the populations streaming towards it from its neighbors, collides them
+	 * and writes the result to out. Everything else, including the
+	 * outermost rows and columns, keeps its values. For the no-slip
+	 * reflection, each obstacle a fluid cell pulls from is handed the cell's
+	 * own opposite population before the sweep, so that the sweep never
+	 * looks at the neighbors. Tiles without fluid are skipped entirely. */
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::stream_collide(PlaneGrid<Real, 9>& in,
+								 PlaneGrid<Real, 9>& out,
+								 size_t first_row, size_t last_row) {
+		typedef Pack<Real> P;
+		first_row = max(first_row, (size_t)1);
+		last_row = min(last_row, gridHeight - 1);
+		if(first_row >= last_row) return;
+		const size_t pitch = in.pitch();
+		const size_t first_link = no_slip_rows[first_row];
+		const size_t last_link = no_slip_rows[last_row];
+		Real* data = in.data();
+		for(size_t l = first_link; l < last_link; ++l) {
+			data[no_slip_links[l].wall] = data[no_slip_links[l].cell];
+		}
+#pragma omp parallel for schedule(static)
+		for(size_t iy = first_row; iy < last_row; ++iy) {
+			const Real* own[9];
+			const Real* from[9];
+			Real* to[9];
+			for(size_t i = 0; i < 9; ++i) {
+				own[i] = in.row(i, iy);
+				from[i] = in.row(i, iy + dy[i]) + dx[i];
+				to[i] = out.row(i, iy);
+			}
+			for(size_t tx = 0; tx < pitch; tx += tile_size) {
+				if(!active_tiles[tile(tx, iy)]) continue;
+				const size_t end = min(tx + tile_size, pitch);
+				for(size_t ix = tx; ix < end; ix += P::width) {
+					P old[9];
+					for(size_t i = 0; i < 9; ++i) old[i] = P::load(own[i] + ix);
+					typename P::Mask update = updated<P>(flags, ix, iy);
+					if(!update.any()) {
+						for(size_t i = 0; i < 9; ++i) old[i].store(to[i] + ix);
+						continue;
+					}
+					P f[9];
+					for(size_t i = 0; i < 9; ++i) f[i] = P::loadu(from[i] + ix);
+					Collision::collide(f);
+					for(size_t i = 0; i < 9; ++i) {
+						select(update, f[i], old[i]).store(to[i] + ix);
+					}
 				}
 			}
-			/* exchanging values */
-#pragma omp parallel for
-			for(size_t iy = 1; iy < gridHeight - 1; ++iy) {
-				for(size_t ix = 1; ix < gridWidth - 1; ++ix) {
-					if(src(ix, iy).type != cell_t::FLUID) continue;
-					dest(ix, iy).NW = src(ix + 1, iy + 1).NW;
-					dest(ix, iy).N  = src(ix    , iy + 1).N ;
-					dest(ix, iy).NE = src(ix - 1, iy + 1).NE;
-					dest(ix, iy).W  = src(ix + 1, iy    ).W ;
-					dest(ix, iy).C  = src(ix    , iy    ).C ;
-					dest(ix, iy).E  = src(ix - 1, iy    ).E ;
-					dest(ix, iy).SW = src(ix + 1, iy - 1).SW;
-					dest(ix, iy).S  = src(ix    , iy - 1).S ;
-					dest(ix, iy).SE = src(ix - 1, iy - 1).SE;
+		}
+		/* the obstacles might lie in rows of in that are still to be
+		 * read, or in rows of out that are already written */
+		for(size_t l = first_link; l < last_link; ++l) {
+			in.data()[no_slip_links[l].wall] = no_slip_links[l].saved;
+			out.data()[no_slip_links[l].wall] = no_slip_links[l].saved;
+		}
+	}
+
+	/* Performs steps timesteps in a single pass over the grid, to keep the
+	 * rows in cache while they are needed (temporal blocking). Row blocks
+	 * of block_height rows are processed top down, with each timestep one
+	 * row behind the previous one. So a timestep always finds the rows
+	 * below it already updated by the previous timestep, and src and dest
+	 * suffice: when a row is written, the previous timestep has already
+	 * read the value it overwrites. The results are identical to steps
+	 * calls of one_iteration(). */
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::wavefront(size_t steps) {
+		PlaneGrid<Real, 9>* grid[2] = { &src, &dest };
+		const ptrdiff_t height = block_height;
+		for(ptrdiff_t front = 1; front < (ptrdiff_t)(gridHeight + steps) - 2;
+			front += height) {
+			for(size_t t = 0; t < steps; ++t) {
+				const ptrdiff_t first_row = front - (ptrdiff_t)t;
+				if(first_row + height <= 1) break;
+				stream_collide(*grid[t % 2], *grid[(t + 1) % 2],
+							   max(first_row, (ptrdiff_t)1),
+							   first_row + height);
+			}
+		}
+		if(steps % 2) PlaneGrid<Real, 9>::swap(src, dest);
+	}
+
+	/* The in-place streaming mode follows the AA-pattern and works on src
+	 * alone. Starting from the natural layout, the even step pulls exactly
+	 * like stream_collide(), but pushes the result to the neighbors in
+	 * reversed order: the population of a cell heading in direction i is
+	 * stored as the opposite population of the neighbor in direction i.
+	 * Afterwards, the populations pushed into cells that are not updated
+	 * are fetched back along the links: reflected at obstacles, and
+	 * replaced by what the neighbor emits otherwise. The odd step then finds
+	 * all its populations at home, in reversed order, and restores the
+	 * natural layout. Every memory location is read and written by a single
+	 * cell only, so both steps are free of races, and the results are
+	 * identical to two steps of stream_collide(). */
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::aa_even_step() {
+		typedef Pack<Real> P;
+		const size_t pitch = src.pitch();
+		Real* data = src.data();
+		for(const Link& link : no_slip_links) data[link.wall] = data[link.cell];
+#pragma omp parallel for schedule(static)
+		for(size_t iy = 1; iy < gridHeight - 1; ++iy) {
+			const Real* from[9];
+			Real* to[9];
+			for(size_t i = 0; i < 9; ++i) {
+				from[i] = src.row(i, iy + dy[i]) + dx[i];
+				to[i] = src.row(8 - i, iy - dy[i]) - dx[i];
+			}
+			for(size_t tx = 0; tx < pitch; tx += tile_size) {
+				if(!active_tiles[tile(tx, iy)]) continue;
+				const size_t end = min(tx + tile_size, pitch);
+				for(size_t ix = tx; ix < end; ix += P::width) {
+					typename P::Mask update = updated<P>(flags, ix, iy);
+					if(!update.any()) continue;
+					P f[9];
+					for(size_t i = 0; i < 9; ++i) f[i] = P::loadu(from[i] + ix);
+					Collision::collide(f);
+					for(size_t i = 0; i < 9; ++i) f[i].storeu(to[i] + ix, update);
 				}
 			}
 		}
+		for(const Link& link : no_slip_links) {
+			data[link.cell] = data[link.wall];
+			data[link.wall] = link.saved;
+		}
+		for(const Link& link : passive_links) {
+			data[link.cell] = link.saved;
+			data[link.wall] = link.saved;
+		}
+	}
 
-		/* the collision step of the MRT-LBM simulation. The moments of each
-		 * cell are calculated and individually relaxed towards equilibrium. */
-		void MRT_LBM::collide() {
-			float omega = 1.8;
-#pragma omp parallel for
-			for(size_t iy = 0; iy < gridHeight; ++iy) {
-				for(size_t ix = 0; ix < gridWidth; ++ix) {
-					Cell& cell = src(ix, iy);
-					if(cell.type != cell_t::FLUID) {
-						// TODO updata vel and dens with newer moments
-						continue;
+	template<typename Collision, typename Real>
+	void CPU_LBM<Collision, Real>::aa_odd_step() {
+		typedef Pack<Real> P;
+		const size_t pitch = src.pitch();
+#pragma omp parallel for schedule(static)
+		for(size_t iy = 1; iy < gridHeight - 1; ++iy) {
+			Real* own[9];
+			for(size_t i = 0; i < 9; ++i) own[i] = src.row(i, iy);
+			for(size_t tx = 0; tx < pitch; tx += tile_size) {
+				if(!active_tiles[tile(tx, iy)]) continue;
+				const size_t end = min(tx + tile_size, pitch);
+				for(size_t ix = tx; ix < end; ix += P::width) {
+					typename P::Mask update = updated<P>(flags, ix, iy);
+					if(!update.any()) continue;
+					P old[9];
+					for(size_t i = 0; i < 9; ++i) old[i] = P::load(own[i] + ix);
+					P f[9];
+					for(size_t i = 0; i < 9; ++i) f[i] = old[8 - i];
+					Collision::collide(f);
+					for(size_t i = 0; i < 9; ++i) {
+						select(update, f[i], old[i]).store(own[i] + ix);
 					}
-					float p1 = 1.63;
-					float p2 = 1.14;
-					float p4 = 1.9;
-					float p6 = 1.92;
-					float p7 = omega;
-					float p8 = omega;
-
-					// calculation of the moments
-					float m0; // the density
-					float m1; // the energy
-					float m2; // energy squared
-					float m3; // momentum x
-					float m4; // heatflow x
-					float m5; // momentum y
-					float m6; // heatflow y
-					float m7; // diagonal stress
-					float m8; // off-diagonal stress
-					m0 =         cell.NW +       cell.N +       cell.NE
-						+       cell.W  +       cell.C +       cell.E
-						+       cell.SW +       cell.S +       cell.SE;
-
-					m1 =   2.0 * cell.NW -       cell.N + 2.0 * cell.NE
-						-       cell.W  - 4.0 * cell.C -       cell.E
-						+ 2.0 * cell.SW -       cell.S + 2.0 * cell.SE;
-
-					m2 =        cell.NW - 2.0 * cell.N +       cell.NE
-						- 2.0 * cell.W  + 4.0 * cell.C - 2.0 * cell.E
-						+       cell.SW - 2.0 * cell.S +       cell.SE;
-
-					m3 = -       cell.NW +          0.0 +       cell.NE
-						-       cell.W  +          0.0 +       cell.E
-						-       cell.SW +          0.0 +       cell.SE;
-
-					m4 = -       cell.NW +          0.0 +       cell.NE
-						+ 2.0 * cell.W  +          0.0 - 2.0 * cell.E
-						-       cell.SW +          0.0 +       cell.SE;
-
-					m5 =         cell.NW +       cell.N +       cell.NE
-						+           0.0 +          0.0 +           0.0
-						-       cell.SW -       cell.S -       cell.SE;
-
-					m6 =         cell.NW - 2.0 * cell.N +       cell.NE
-						+           0.0 +          0.0 +           0.0
-						-       cell.SW + 2.0 * cell.S -       cell.SE;
-
-					m7 =             0.0 -       cell.N +           0.0
-						+       cell.W  +          0.0 +       cell.E
-						+           0.0 -       cell.S +           0.0;
-
-					m8 = -       cell.NW +          0.0 +       cell.NE
-						+           0.0 +          0.0 +           0.0
-						+       cell.SW +          0.0 -       cell.SE;
-
-					float vSquared = m3 * m3 + m5 * m5;
-
-					if(vSquared > 0.05) p7 = p8 = 0.00025/vSquared/vSquared;
-
-					// moment relaxation
-					m1 -= p1 * (m1 + (2.0 * m0 - 3.0 * vSquared));
-					m2 -= p2 * (m2 - (m0 - 3.0 * vSquared));
-					m4 -= p4 * (m4 + m3);
-					m6 -= p6 * (m6 + m5);
-					m7 -= p7 * (m7 - (m3 * m3 - m5 * m5));
-					m8 -= p8 * (m8 - m3 * m5);
-
-					// back transformation of the moments
-					m0 = 4.0 * m0;
-					m3 = 6.0 * m3;
-					m4 = 3.0 * m4;
-					m5 = 6.0 * m5;
-					m6 = 3.0 * m6;
-					m7 = 9.0 * m7;
-					m8 = 9.0 * m8;
-					cell.NW = (m0 +2.0*m1 +    m2 -m3 -    m4 +m5 +    m6     -m8)/36.0;
-					cell.N  = (m0 -    m1 -2.0*m2             +m5 -2.0*m6 -m7    )/36.0;
-					cell.NE = (m0 +2.0*m1 +    m2 +m3 +    m4 +m5 +    m6     +m8)/36.0;
-					cell.W  = (m0 -    m1 -2.0*m2 -m3 +2.0*m4             +m7    )/36.0;
-					cell.C  = (m0 -4.0*m1 +4.0*m2                                )/36.0;
-					cell.E  = (m0 -    m1 -2.0*m2 +m3 -2.0*m4             +m7    )/36.0;
-					cell.SW = (m0 +2.0*m1 +    m2 -m3 -    m4 -m5 -    m6     +m8)/36.0;
-					cell.S  = (m0 -    m1 -2.0*m2             -m5 +2.0*m6 -m7    )/36.0;
-					cell.SE = (m0 +2.0*m1 +    m2 +m3 +    m4 -m5 -    m6     -m8)/36.0;
-					if(cell.NW  < 0.0) cell.NW  = 0.0;
-					if(cell.N   < 0.0) cell.N   = 0.0;
-					if(cell.NE  < 0.0) cell.NE  = 0.0;
-					if(cell.W   < 0.0) cell.W   = 0.0;
-					if(cell.C   < 0.0) cell.C   = 0.0;
-					if(cell.E   < 0.0) cell.E   = 0.0;
-					if(cell.SW  < 0.0) cell.SW  = 0.0;
-					if(cell.S   < 0.0) cell.S   = 0.0;
-					if(cell.SE  < 0.0) cell.SE  = 0.0;
-
-					/* stability workaround */
-					if(cell.NW > 10.0e5) cell.NW  /= 2.0;
-					if(cell.N  > 10.0e5) cell.N   /= 2.0;
-					if(cell.NE > 10.0e5) cell.NE  /= 2.0;
-					if(cell.W  > 10.0e5) cell.W   /= 2.0;
-					if(cell.C  > 10.0e5) cell.C   /= 2.0;
-					if(cell.E  > 10.0e5) cell.E   /= 2.0;
-					if(cell.SW > 10.0e5) cell.SW  /= 2.0;
-					if(cell.S  > 10.0e5) cell.S   /= 2.0;
-					if(cell.SE > 10.0e5) cell.SE  /= 2.0;
 				}
 			}
 		}
 	}
+
+	template class CPU_LBM<BGK, float>;
+	template class CPU_LBM<BGK, double>;
+	template class CPU_LBM<TRT, float>;
+	template class CPU_LBM<TRT, double>;
+	template class CPU_LBM<MRT, float>;
+	template class CPU_LBM<MRT, double>;
+}
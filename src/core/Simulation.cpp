@@ -15,12 +15,18 @@ details.
 You should have received a copy of the GNU Affero General Public License along
 with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
+#include <algorithm>
 #include <cmath>
+#include <exception>
 #include <iostream>
 #include <fstream>
 #include <iterator>
 #include <cstring>
+#include <chrono>
+#include <functional>
+#include <thread>
 #include "core/Simulation.hpp"
+#include "core/SimulationUtilities.hpp"
 #include "core/MRT_LBM.hpp"
 #include "core/BGK_OCL.hpp"
 
@@ -28,63 +34,280 @@ using namespace std;
 
 namespace Feldrand {
 
-	typedef BGK_OCL SimulationType;
+	namespace {
+		typedef Simulation::SimulationImplementation Implementation;
+
+		/* how long each backend runs when choosing one automatically, and
+		 * how long it may take for its first timestep */
+		const chrono::milliseconds calibration_time(200);
+		const chrono::seconds calibration_timeout(5);
+
+		/* An entry of the backend registry. Each function returns a new
+		 * SimulationImplementation whose work thread is not started yet. */
+		struct Backend {
+			string name;
+			function<Implementation*(double, double, size_t, size_t)> create;
+			function<Implementation*(string)> create_from_image;
+			function<Implementation*()> create_empty;
+			function<Implementation*(Implementation&)> copy;
+		};
+
+		/* The CPU solvers have no image constructor, the image is drawn as
+		 * obstacles right after the construction instead. */
+		template<typename T>
+		Backend cpu_backend(string name) {
+			Backend b;
+			b.name = name;
+			b.create = [](double width, double height,
+						  size_t grid_width, size_t grid_height)
+				-> Implementation* {
+				return new T(width, height, grid_width, grid_height);
+			};
+			b.create_from_image = [](string filename) -> Implementation* {
+				auto mask = createImageMask(filename);
+				T* sim = new T(mask->x() * 0.001, mask->y() * 0.001,
+							   mask->x(), mask->y());
+				Simulation::draw_data data = {
+					(int)mask->x() / 2, (int)mask->y() / 2,
+					mask, cell_t::OBSTACLE
+				};
+				sim->template action<Simulation::draw_data&>(
+					Simulation::Action::draw, data);
+				return sim;
+			};
+			b.create_empty = []() -> Implementation* { return new T(); };
+			b.copy = [](Implementation& other) -> Implementation* {
+				return new T(static_cast<T&>(other));
+			};
+			return b;
+		}
+
+		Backend ocl_backend(int device, bool hybrid = false) {
+			Backend b;
+			b.name = string(hybrid ? "BGK_OCL+CPU:" : "BGK_OCL:") +
+				(device == BGK_OCL::all_devices
+				 ? string("all") : to_string(device));
+			b.create = [device, hybrid](double width, double height,
+										size_t grid_width, size_t grid_height)
+				-> Implementation* {
+				return new BGK_OCL(width, height,
+								   grid_width, grid_height, device, hybrid);
+			};
+			b.create_from_image = [device, hybrid](string filename)
+				-> Implementation* {
+				return new BGK_OCL(filename, device, hybrid);
+			};
+			b.create_empty = []() -> Implementation* { return new BGK_OCL(); };
+			b.copy = [](Implementation& other) -> Implementation* {
+				return new BGK_OCL(static_cast<BGK_OCL&>(other));
+			};
+			return b;
+		}
+
+		/* The OpenCL devices are only looked up once. */
+		const vector<Backend>& registry() {
+			static const vector<Backend> backends = [] {
+				vector<Backend> result;
+				if(BGK_OCL::devices() > 1) {
+					result.push_back(ocl_backend(BGK_OCL::all_devices));
+				}
+				for(int device = 0; device < BGK_OCL::devices(); ++device) {
+					result.push_back(ocl_backend(device));
+				}
+				for(int device = 0; device < BGK_OCL::devices(); ++device) {
+					result.push_back(ocl_backend(device, true));
+				}
+				result.push_back(cpu_backend<MRT_LBM>("MRT_LBM"));
+				result.push_back(cpu_backend<TRT_LBM>("TRT_LBM"));
+				result.push_back(cpu_backend<BGK_LBM>("BGK_LBM"));
+				return result;
+			}();
+			return backends;
+		}
+
+		const Backend& find(const string& name) {
+			for(const Backend& b : registry()) {
+				if(b.name == name) return b;
+			}
+			throw runtime_error("unknown or unavailable backend " + name);
+		}
+
+		/* Timesteps per second of b on a grid_width x grid_height grid, or 0
+		 * if b fails to initialize or to complete a timestep within
+		 * calibration_timeout, in which case its simulation is left
+		 * behind. The clock only starts after the first timestep. */
+		double calibrate(const Backend& b, size_t grid_width, size_t grid_height) {
+			using namespace std::chrono;
+			unique_ptr<Implementation> sim;
+			try {
+				sim.reset(b.create(1.0, 1.0, grid_width, grid_height));
+				sim->start();
+			} catch(const exception&) {
+				return 0.0;
+			}
+			sim->action(Simulation::Action::run);
+			const auto started = high_resolution_clock::now();
+			size_t first;
+			while(0 == (first = sim->get<size_t>(Simulation::Data::timestep_id))) {
+				if(high_resolution_clock::now() - started > calibration_timeout) {
+					/* stop() would join a work thread that may never
+					 * return from its step, so the simulation is paused
+					 * and abandoned instead */
+					sim->action(Simulation::Action::pause);
+					sim.release();
+					return 0.0;
+				}
+				this_thread::sleep_for(milliseconds(1));
+			}
+			auto begin = high_resolution_clock::now();
+			this_thread::sleep_for(calibration_time);
+			size_t last = sim->get<size_t>(Simulation::Data::timestep_id);
+			auto end = high_resolution_clock::now();
+			sim->stop();
+			return (last - first) / duration<double>(end - begin).count();
+		}
+
+		/* The backends to try for name, in order: the one named, every one
+		 * for "default", or for "auto" those that calibrate() could run,
+		 * fastest first. */
+		vector<const Backend*> candidates(const string& name,
+										  size_t grid_width, size_t grid_height) {
+			vector<const Backend*> result;
+			if("auto" == name && registry().size() > 1) {
+				vector<pair<double, const Backend*>> rates;
+				for(const Backend& b : registry()) {
+					double rate = calibrate(b, grid_width, grid_height);
+					if(rate > 0.0) rates.emplace_back(rate, &b);
+				}
+				stable_sort(rates.begin(), rates.end(),
+							[](const pair<double, const Backend*>& a,
+							   const pair<double, const Backend*>& b) {
+								return a.first > b.first;
+							});
+				for(const auto& rate : rates) result.push_back(rate.second);
+				if(!result.empty()) return result;
+			}
+			if("auto" == name || "default" == name) {
+				for(const Backend& b : registry()) result.push_back(&b);
+				return result;
+			}
+			result.push_back(&find(name));
+			return result;
+		}
+
+		/* Creates and starts a simulation with the first of the backends
+		 * whose initialization succeeds, and rethrows the failure of the
+		 * last one if none does. */
+		Implementation* start_first(const vector<const Backend*>& backends,
+									function<Implementation*(const Backend&)> create,
+									string& name) {
+			exception_ptr failure;
+			for(const Backend* b : backends) {
+				try {
+					unique_ptr<Implementation> sim(create(*b));
+					sim->start();
+					name = b->name;
+					return sim.release();
+				} catch(const exception&) {
+					failure = current_exception();
+				}
+			}
+			rethrow_exception(failure);
+		}
+	}
 
 	Simulation Simulation::create_dwdhgt(double width,
 										 double height,
-										 size_t total_points) {
+										 size_t total_points,
+										 const string& backend) {
 		size_t grid_width
 			= (size_t)ceil(sqrt( (width  / height) * (double)total_points));
 		size_t grid_height
 			= (size_t)ceil(sqrt( (height /  width) * (double)total_points));
-		return Simulation{width, height, grid_width, grid_height};
+		return Simulation{width, height, grid_width, grid_height, backend};
 	}
 
 	Simulation Simulation::create_dwdhgw(double width,
 										 double height,
-										 size_t grid_width) {
+										 size_t grid_width,
+										 const string& backend) {
 		size_t grid_height = (size_t)(height / width) * grid_width;
-		return Simulation{width, height, grid_width, grid_height};
+		return Simulation{width, height, grid_width, grid_height, backend};
 	}
 
 	Simulation Simulation::create_dwdhgh(double width,
 										 double height,
-										 size_t grid_height) {
+										 size_t grid_height,
+										 const string& backend) {
 		size_t grid_width = (width / height) * grid_height;
-		return Simulation{width, height, grid_width, grid_height};
+		return Simulation{width, height, grid_width, grid_height, backend};
+	}
+    Simulation Simulation::create_from_image(std::string filename,
+											 const string& backend) {
+        return Simulation(filename, backend);
 	}
-    Simulation Simulation::create_from_image(std::string filename) {
-        return Simulation(filename);
+
+	vector<string> Simulation::backends() {
+		vector<string> names;
+		for(const Backend& b : registry()) names.push_back(b.name);
+		return names;
 	}
 
 	Simulation::Simulation(double width /*in meters*/,
 						   double height /*in meters*/,
 						   size_t grid_width,
-						   size_t grid_height)
-		:impl(new SimulationType(width, height,
-						  grid_width,
-						  grid_height)) {}
+						   size_t grid_height,
+						   const string& backend) {
+		impl = start_first(
+			candidates(backend, grid_width, grid_height),
+			[&](const Backend& b) {
+				return b.create(width, height, grid_width, grid_height);
+			},
+			backend_name);
+	}
 
-    Simulation::Simulation(std::string filename)
-		:impl(new SimulationType(filename)) {}
+    Simulation::Simulation(std::string filename, const string& backend) {
+		size_t grid_width = 0;
+		size_t grid_height = 0;
+		if("auto" == backend) {
+			auto mask = createImageMask(filename);
+			grid_width = mask->x();
+			grid_height = mask->y();
+		}
+		impl = start_first(
+			candidates(backend, grid_width, grid_height),
+			[&](const Backend& b) { return b.create_from_image(filename); },
+			backend_name);
+	}
 
-	Simulation::Simulation()
-		:impl(new SimulationType()) {}
+	Simulation::Simulation() {
+		impl = start_first(
+			candidates("default", 0, 0),
+			[](const Backend& b) { return b.create_empty(); },
+			backend_name);
+	}
 
 	Simulation::Simulation(Simulation&& other)
-		: impl(other.impl) {
+		: impl(other.impl), backend_name(other.backend_name) {
 		other.impl = nullptr;
 	}
 
-	Simulation::Simulation(const Simulation& other) {
+	Simulation::Simulation(const Simulation& other)
+		: backend_name(other.backend_name) {
 		// TODO
-		impl = new SimulationType(static_cast<SimulationType&>(*(other.impl)));
+		impl = find(backend_name).copy(*(other.impl));
+		impl->start();
 	}
 
 	Simulation::~Simulation() {
+		if(impl) impl->stop();
 		delete impl;
 	}
 
+	const string& Simulation::backend() const {
+		return backend_name;
+	}
+
 	void Simulation::action(Simulation::Action what) {
 		impl->action(what);
 	}
@@ -100,6 +323,28 @@ namespace Feldrand {
 		impl->action<size_t>(what, data);
 	}
 
+	template<> void
+	Simulation::action<double>(Simulation::Action what, double data) {
+		impl->action<double>(what, data);
+	}
+
+	template<> void
+	Simulation::action<streaming_t>(Simulation::Action what, streaming_t data) {
+		impl->action<streaming_t>(what, data);
+	}
+
+	template<> void
+	Simulation::action<Simulation::blocking_data>(Simulation::Action what,
+												  Simulation::blocking_data data) {
+		impl->action<Simulation::blocking_data>(what, data);
+	}
+
+	template<> void
+	Simulation::action<Simulation::threads_data>(Simulation::Action what,
+												 Simulation::threads_data data) {
+		impl->action<Simulation::threads_data>(what, data);
+	}
+
 	template<>
 	auto Simulation::get(Simulation::Data what) -> double {
 		return impl->get<double>(what);
@@ -120,11 +365,33 @@ namespace Feldrand {
 		return impl->get<Grid<float>*>(what);
 	}
 
+	template<>
+	auto Simulation::get(Simulation::Data what)
+		-> shared_ptr<const Grid<Vec2D<float>>> {
+		return impl->get<shared_ptr<const Grid<Vec2D<float>>>>(what);
+	}
+
+	template<>
+	auto Simulation::get(Simulation::Data what)
+		-> shared_ptr<const Grid<float>> {
+		return impl->get<shared_ptr<const Grid<float>>>(what);
+	}
+
 	template<>
 	auto Simulation::get(Simulation::Data what) -> Grid<cell_t>* {
 		return impl->get<Grid<cell_t>*>(what);
 	}
 
+	template<>
+	auto Simulation::get(Simulation::Data what) -> Simulation::frame_data {
+		return impl->get<Simulation::frame_data>(what);
+	}
+
+	template<>
+	auto Simulation::get(Simulation::Data what) -> Simulation::perf_data {
+		return impl->get<Simulation::perf_data>(what);
+	}
+
 	void Simulation::beginMultiple() {
 		impl->beginMultiple();
 	}
@@ -147,14 +414,19 @@ namespace Feldrand {
 
 	std::ostream& operator<<(std::ostream& dest, const Simulation::Data& what) {
 		switch(what) {
-		case Simulation::Data::width: dest << string("width");
-		case Simulation::Data::height: dest << string("height");
-		case Simulation::Data::gridWidth: dest << string("gridWidth");
-		case Simulation::Data::gridHeight: dest << string("gridHeight");
-		case Simulation::Data::timestep_id: dest << string("timestep_id");
-		case Simulation::Data::velocity_grid: dest << string("velocity_grid");
-		case Simulation::Data::density_grid: dest << string("density_grid");
-		case Simulation::Data::type_grid: dest << string("type_grid");
+		case Simulation::Data::width: return dest << string("width");
+		case Simulation::Data::height: return dest << string("height");
+		case Simulation::Data::gridWidth: return dest << string("gridWidth");
+		case Simulation::Data::gridHeight: return dest << string("gridHeight");
+		case Simulation::Data::timestep_id: return dest << string("timestep_id");
+		case Simulation::Data::steps_per_second: return dest << string("steps_per_second");
+		case Simulation::Data::realtime_factor: return dest << string("realtime_factor");
+		case Simulation::Data::velocity_grid: return dest << string("velocity_grid");
+		case Simulation::Data::density_grid: return dest << string("density_grid");
+		case Simulation::Data::type_grid: return dest << string("type_grid");
+		case Simulation::Data::vorticity_grid: return dest << string("vorticity_grid");
+		case Simulation::Data::frame: return dest << string("frame");
+		case Simulation::Data::perf_stats: return dest << string("perf_stats");
 		default: break;
 		}
 		dest << string("unknown");
@@ -163,11 +435,17 @@ namespace Feldrand {
 
 	std::ostream& operator<<(std::ostream& dest, const Simulation::Action& what) {
 		switch(what) {
-		case Simulation::Action::pause: dest << string("pause");
-		case Simulation::Action::run: dest << string("run");
-		case Simulation::Action::clear: dest << string("clear");
-		case Simulation::Action::draw: dest << string("draw");
-		case Simulation::Action::steps: dest << string("steps");
+		case Simulation::Action::pause: return dest << string("pause");
+		case Simulation::Action::run: return dest << string("run");
+		case Simulation::Action::clear: return dest << string("clear");
+		case Simulation::Action::draw: return dest << string("draw");
+		case Simulation::Action::steps: return dest << string("steps");
+		case Simulation::Action::streaming: return dest << string("streaming");
+		case Simulation::Action::blocking: return dest << string("blocking");
+		case Simulation::Action::threads: return dest << string("threads");
+		case Simulation::Action::publishing: return dest << string("publishing");
+		case Simulation::Action::speed: return dest << string("speed");
+		case Simulation::Action::latency: return dest << string("latency");
 		default: break;
 		}
 		dest << string("unknown");
@@ -18,6 +18,8 @@ with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <thread>
 #include <future>
 #include <mutex>
+#include <algorithm>
+#include <climits>
 #include <cmath>
 #include <chrono>
 #include <iostream>
@@ -31,6 +33,20 @@ using namespace std;
 
 namespace Feldrand {
 
+namespace {
+    double seconds_since(chrono::high_resolution_clock::time_point start) {
+        using namespace std::chrono;
+        return duration<double>(high_resolution_clock::now() - start).count();
+    }
+
+    /* the weight of the latest round in the rolling statistics */
+    const double rolling_weight = 1.0 / 16.0;
+
+    void roll(double& average, double value) {
+        average += rolling_weight * (value - average);
+    }
+}
+
 Simulation::SimulationImplementation::
 SimulationImplementation(double width,
                          double height,
@@ -40,15 +56,26 @@ SimulationImplementation(double width,
       gridWidth(grid_width),
       gridHeight(grid_height),
       kinematic_viscosity(1.0),
-      speed(1.0),
+      speed(0.0),
       ts_id(0),
+      steps_per_second(0.0),
+      realtime_factor(0.0),
+      iterations_per_second(0.0),
+      batch(1),
+      latency(0.01),
+      simulated(0.0),
+      work_thread(nullptr),
+      multiple_owner(thread::id()),
+      publish_interval(1),
+      unpublished_steps(0),
+      unpublished_changes(true),
+      frames_wanted(false),
+      round_totals(),
+      perf(),
       pause(true),
       join(false),
       stepsToDo(0)
-{
-    work_thread
-        = new thread{&Simulation::SimulationImplementation::loop, this};
-}
+{}
 
 Simulation::SimulationImplementation::
 SimulationImplementation()
@@ -58,13 +85,24 @@ SimulationImplementation()
       kinematic_viscosity(0.0),
       speed(0.0),
       ts_id(0),
+      steps_per_second(0.0),
+      realtime_factor(0.0),
+      iterations_per_second(0.0),
+      batch(1),
+      latency(0.01),
+      simulated(0.0),
+      work_thread(nullptr),
+      multiple_owner(thread::id()),
+      publish_interval(1),
+      unpublished_steps(0),
+      unpublished_changes(true),
+      frames_wanted(false),
+      round_totals(),
+      perf(),
       pause(true),
       join(false),
       stepsToDo(0)
-{
-    work_thread
-        = new thread{&Simulation::SimulationImplementation::loop, this};
-}
+{}
 
 Simulation::SimulationImplementation::
 SimulationImplementation(const SimulationImplementation& other)
@@ -74,24 +112,58 @@ SimulationImplementation(const SimulationImplementation& other)
       kinematic_viscosity(other.kinematic_viscosity),
       speed(other.speed),
       ts_id(other.ts_id),
+      steps_per_second(0.0),
+      realtime_factor(0.0),
+      iterations_per_second(0.0),
+      batch(1),
+      latency(0.01),
+      simulated(0.0),
+      work_thread(nullptr),
+      multiple_owner(thread::id()),
+      publish_interval(1),
+      unpublished_steps(0),
+      unpublished_changes(true),
+      frames_wanted(false),
+      round_totals(),
+      perf(),
       pause(other.pause),
       join(other.join),
       stepsToDo(other.stepsToDo)
-{
-    work_thread
-        = new thread{&Simulation::SimulationImplementation::loop, this};
-}
+{}
 
 Simulation::SimulationImplementation::
 ~SimulationImplementation() {
+    stop();
+}
+
+void Simulation::SimulationImplementation::
+start() {
+    if(work_thread) return;
+    join = false;
+    promise<void> initialized;
+    work_thread = new thread{&Simulation::SimulationImplementation::loop,
+                             this, &initialized};
+    try {
+        initialized.get_future().get();
+    } catch(...) {
+        work_thread->join();
+        delete work_thread;
+        work_thread = nullptr;
+        throw;
+    }
+}
+
+void Simulation::SimulationImplementation::
+stop() {
+    if(!work_thread) return;
     join = true;
     work_thread->join();
     delete work_thread;
+    work_thread = nullptr;
 }
 
 void Simulation::SimulationImplementation::
 action(Action what) {
-    lock_guard<mutex> lock(todo_queue_mutex);
     switch(what) {
     case Action::pause:
         do_pause();
@@ -99,9 +171,12 @@ action(Action what) {
     case Action::run:
         do_run();
         break;
-    case Action::clear:
-        todo_queue.push([this]{do_clear();});
+    case Action::clear: {
+        Command command = {};
+        command.kind = Command::Kind::clear;
+        enqueue(command);
         break;
+    }
     default:
         throw runtime_error(string("invalid Action or type "));
     }
@@ -110,18 +185,17 @@ action(Action what) {
 template<>
 void Simulation::SimulationImplementation::
 action(Action what, Simulation::draw_data& data) {
-    lock_guard<mutex> lock(todo_queue_mutex);
     switch(what) {
-    case Action::draw:
-        todo_queue.push(bind([this]
-                             (int x, int y,
-                              shared_ptr<const Grid<mask_t>> mask_ptr,
-                              cell_t type) {
-                                 do_draw(x, y, mask_ptr, type);
-                             },
-                             data.x, data.y,
-                             data.mask_ptr, data.type));
+    case Action::draw: {
+        Command command = {};
+        command.kind = Command::Kind::draw;
+        command.x = data.x;
+        command.y = data.y;
+        command.mask_ptr = data.mask_ptr;
+        command.type = data.type;
+        enqueue(command);
         break;
+    }
     default:
         throw runtime_error(string("invalid Action or type "));
     }
@@ -131,11 +205,93 @@ template<>
 void Simulation::SimulationImplementation::
 action(Action what, size_t data) {
     switch(what) {
-    case Action::steps:
-        todo_queue.push(bind([this] (size_t steps) {
-                                 do_steps(steps);
-                             }, data));
+    case Action::steps: {
+        Command command = {};
+        command.kind = Command::Kind::steps;
+        command.first = data;
+        enqueue(command);
+        break;
+    }
+    case Action::publishing: {
+        Command command = {};
+        command.kind = Command::Kind::publishing;
+        command.first = data;
+        enqueue(command);
+        break;
+    }
+    default:
+        throw runtime_error(string("invalid Action or type "));
+    }
+}
+
+template<>
+void Simulation::SimulationImplementation::
+action(Action what, double data) {
+    switch(what) {
+    case Action::speed: {
+        Command command = {};
+        command.kind = Command::Kind::speed;
+        command.value = data;
+        enqueue(command);
+        break;
+    }
+    case Action::latency: {
+        Command command = {};
+        command.kind = Command::Kind::latency;
+        command.value = data;
+        enqueue(command);
+        break;
+    }
+    default:
+        throw runtime_error(string("invalid Action or type "));
+    }
+}
+
+template<>
+void Simulation::SimulationImplementation::
+action(Action what, streaming_t data) {
+    switch(what) {
+    case Action::streaming: {
+        Command command = {};
+        command.kind = Command::Kind::streaming;
+        command.mode = data;
+        enqueue(command);
+        break;
+    }
+    default:
+        throw runtime_error(string("invalid Action or type "));
+    }
+}
+
+template<>
+void Simulation::SimulationImplementation::
+action(Action what, Simulation::blocking_data data) {
+    switch(what) {
+    case Action::blocking: {
+        Command command = {};
+        command.kind = Command::Kind::blocking;
+        command.first = data.block_height;
+        command.second = data.temporal_depth;
+        enqueue(command);
+        break;
+    }
+    default:
+        throw runtime_error(string("invalid Action or type "));
+    }
+}
+
+template<>
+void Simulation::SimulationImplementation::
+action(Action what, Simulation::threads_data data) {
+    switch(what) {
+    case Action::threads: {
+        Command command = {};
+        command.kind = Command::Kind::threads;
+        command.first = data.count;
+        command.affinity = data.affinity;
+        enqueue(command);
         break;
+    }
     default:
         throw runtime_error(string("invalid Action or type "));
     }
@@ -145,7 +301,6 @@ action(Action what, size_t data) {
 template<>
 auto Simulation::SimulationImplementation::
 get(Data what) -> double {
-    lock_guard<mutex> lock(todo_queue_mutex);
     switch(what) {
     case Data::width:
         return get_width();
@@ -153,6 +308,12 @@ get(Data what) -> double {
     case Data::height:
         return get_height();
         break;
+    case Data::steps_per_second:
+        return get_steps_per_second();
+        break;
+    case Data::realtime_factor:
+        return get_realtime_factor();
+        break;
     default:
         throw runtime_error(string("invalid Data or type "));
     }
@@ -162,8 +323,6 @@ get(Data what) -> double {
 template<>
 auto Simulation::SimulationImplementation::
 get(Data what) -> size_t {
-    lock_guard<mutex> lock(todo_queue_mutex);
-
     switch(what) {
     case Data::gridWidth:
         return get_gridWidth();
@@ -172,6 +331,7 @@ get(Data what) -> size_t {
         return get_gridHeight();
         break;
     case Data::timestep_id:
+        if(in_multiple()) return multiple_snapshot().timestep_id;
         return get_timestep_id();
         break;
     default:
@@ -180,142 +340,537 @@ get(Data what) -> size_t {
     return 0;
 }
 
+void Simulation::SimulationImplementation::
+enqueue(Command& command) {
+    command.queued = chrono::high_resolution_clock::now();
+    todo_queue.push(command);
+}
+
+/* The grids are filled by the work thread, the caller waits for them on a
+ * promise of its own. */
+void* Simulation::SimulationImplementation::
+request(Command::Kind kind, void* grid) {
+    promise<void*> result;
+    Command command = {};
+    command.kind = kind;
+    command.grid = grid;
+    command.result = &result;
+    enqueue(command);
+    return result.get_future().get();
+}
+
+void Simulation::SimulationImplementation::
+fetch(Fields& fields) {
+    request(Command::Kind::fields, &fields);
+}
+
+/* Inside a beginMultiple() block, the grids are copies of the block's
+ * snapshot. */
 template<>
 auto Simulation::SimulationImplementation::
 get(Data what) -> Grid<Vec2D<float>>* {
-    todo_queue_mutex.lock();
-    auto p = new promise<Grid<Vec2D<float>>*>();
-    future<Grid<Vec2D<float>>*> f = p->get_future();
-
-    switch(what) {
-    case Data::velocity_grid:
-        todo_queue.push(bind([this](promise<Grid<Vec2D<float>>*>* p) {
-                    p->set_value(get_velocity_grid());
-                    delete p;
-                }, p));
-        break;
-    default:
-        delete p;
-        todo_queue_mutex.unlock();
+    if(what != Data::velocity_grid)
         throw runtime_error(string("invalid Data or type "));
-    }
-    todo_queue_mutex.unlock();
-    return f.get();
+    if(in_multiple())
+        return new Grid<Vec2D<float>>(*multiple_snapshot().velocity);
+    auto grid = new Grid<Vec2D<float>>(gridWidth, gridHeight);
+    Fields fields = {grid, nullptr, nullptr, 0};
+    fetch(fields);
+    return grid;
 }
 
 template<>
 auto Simulation::SimulationImplementation::
 get(Data what) -> Grid<float>* {
-    todo_queue_mutex.lock();
-    auto p = new promise<Grid<float>*>();
-    future<Grid<float>*> f = p->get_future();
-
-    switch(what) {
-    case Data::density_grid:
-        todo_queue.push(bind([this](promise<Grid<float>*>* p) {
-                    p->set_value(get_density_grid());
-                    delete p;
-                }, p));
-        break;
-    default:
-        delete p;
-        todo_queue_mutex.unlock();
-        throw runtime_error(string("invalid Data or type "));
+    if(what == Data::density_grid && !in_multiple()) {
+        auto grid = new Grid<float>(gridWidth, gridHeight);
+        Fields fields = {nullptr, grid, nullptr, 0};
+        fetch(fields);
+        return grid;
     }
-    todo_queue_mutex.unlock();
-    return f.get();
+    return new Grid<float>(*get<shared_ptr<const Grid<float>>>(what));
 }
 
 template<>
 auto Simulation::SimulationImplementation::
 get(Data what) -> Grid<cell_t>* {
-    todo_queue_mutex.lock();
-    auto p = new promise<Grid<cell_t>*>();
-    future<Grid<cell_t>*> f = p->get_future();
+    if(what != Data::type_grid)
+        throw runtime_error(string("invalid Data or type "));
+    if(in_multiple())
+        return new Grid<cell_t>(*multiple_snapshot().types);
+    auto grid = new Grid<cell_t>(gridWidth, gridHeight);
+    Fields fields = {nullptr, nullptr, grid, 0};
+    fetch(fields);
+    return grid;
+}
+
+/* The snapshots are filled in place, no grid is allocated once the pools
+ * hold enough of them. Inside a beginMultiple() block, they are shared with
+ * the block's snapshot. */
+template<>
+auto Simulation::SimulationImplementation::
+get(Data what) -> shared_ptr<const Grid<Vec2D<float>>> {
+    if(what != Data::velocity_grid)
+        throw runtime_error(string("invalid Data or type "));
+    if(in_multiple()) return multiple_snapshot().velocity;
+    auto snapshot = velocity_snapshots.acquire(gridWidth, gridHeight);
+    Fields fields = {const_cast<Grid<Vec2D<float>>*>(snapshot.get()),
+                     nullptr, nullptr, 0};
+    fetch(fields);
+    return snapshot;
+}
 
+template<>
+auto Simulation::SimulationImplementation::
+get(Data what) -> shared_ptr<const Grid<float>> {
     switch(what) {
-    case Data::type_grid:
-        todo_queue.push(bind([this](promise<Grid<cell_t>*>* p) {
-                    p->set_value(get_type_grid());
-                    delete p;
-                }, p));
-        break;
+    case Data::density_grid: {
+        if(in_multiple()) return multiple_snapshot().density;
+        auto snapshot = density_snapshots.acquire(gridWidth, gridHeight);
+        Fields fields = {nullptr, const_cast<Grid<float>*>(snapshot.get()),
+                         nullptr, 0};
+        fetch(fields);
+        return snapshot;
+    }
+    case Data::vorticity_grid: {
+        if(in_multiple()) {
+            if(!multiple_snapshot().vorticity)
+                multiple.vorticity = vorticity(*multiple.velocity);
+            return multiple.vorticity;
+        }
+        return vorticity(*get<shared_ptr<const Grid<Vec2D<float>>>>(
+                             Data::velocity_grid));
+    }
     default:
-        delete p;
-        todo_queue_mutex.unlock();
         throw runtime_error(string("invalid Data or type "));
     }
-    todo_queue_mutex.unlock();
-    return f.get();
 }
 
+/* The curl of velocity by central differences, computed by the caller from
+ * a snapshot instead of by the work thread from the populations. The cells
+ * at the border of the grid have no vorticity. */
+auto Simulation::SimulationImplementation::
+vorticity(const Grid<Vec2D<float>>& velocity) -> shared_ptr<const Grid<float>> {
+    const size_t x = velocity.x();
+    const size_t y = velocity.y();
+    auto snapshot = density_snapshots.acquire(x, y);
+    Grid<float>& dest = const_cast<Grid<float>&>(*snapshot);
+    for(size_t iy = 0; iy < y; ++iy) {
+        for(size_t ix = 0; ix < x; ++ix) {
+            if(ix == 0 || iy == 0 || ix == x - 1 || iy == y - 1) {
+                dest(ix, iy) = 0.0f;
+                continue;
+            }
+            dest(ix, iy) = 0.5f * (velocity(ix + 1, iy).y
+                                   - velocity(ix - 1, iy).y
+                                   - velocity(ix, iy + 1).x
+                                   + velocity(ix, iy - 1).x);
+        }
+    }
+    return snapshot;
+}
+
+/* Only a call before the first frame waits, for the work thread to
+ * publish it. */
+template<>
+auto Simulation::SimulationImplementation::
+get(Data what) -> Simulation::frame_data {
+    if(what != Data::frame)
+        throw runtime_error(string("invalid Data or type "));
+    frames_wanted = true;
+    Simulation::frame_data frame = frames.latest();
+    if(frame.velocity) return frame;
+    request(Command::Kind::frame, nullptr);
+    return frames.latest();
+}
+
+template<>
+auto Simulation::SimulationImplementation::
+get(Data what) -> Simulation::perf_data {
+    if(what != Data::perf_stats)
+        throw runtime_error(string("invalid Data or type "));
+    Stats latest = stats.latest();
+    if(latest.frame_time != chrono::high_resolution_clock::time_point())
+        latest.perf.snapshot_age = seconds_since(latest.frame_time);
+    return latest.perf;
+}
+
+/* A block holds multiple_mutex, so blocks of different threads take turns.
+ * Its first request for a field takes a snapshot of all of them, with a
+ * single request to the work thread and a single pass of the solver over
+ * its populations, and serves every field request of the block from
+ * there. */
 void Simulation::SimulationImplementation::
 beginMultiple() {
-    lock_guard<mutex> lock(todo_queue_mutex);
-    //multiple_mutex.lock();
+    multiple_mutex.lock();
+    multiple_owner = this_thread::get_id();
 }
 
 void Simulation::SimulationImplementation::
 endMultiple() {
-    lock_guard<mutex> lock(todo_queue_mutex);
-    //multiple_mutex.unlock();
+    multiple = Snapshot();
+    multiple_owner = thread::id();
+    multiple_mutex.unlock();
 }
 
-const size_t iters = 5;
+bool Simulation::SimulationImplementation::
+in_multiple() {
+    return multiple_owner == this_thread::get_id();
+}
+
+auto Simulation::SimulationImplementation::
+multiple_snapshot() -> const Snapshot& {
+    if(multiple.velocity) return multiple;
+    auto velocity = velocity_snapshots.acquire(gridWidth, gridHeight);
+    auto density = density_snapshots.acquire(gridWidth, gridHeight);
+    auto types = type_snapshots.acquire(gridWidth, gridHeight);
+    Fields fields = {const_cast<Grid<Vec2D<float>>*>(velocity.get()),
+                     const_cast<Grid<float>*>(density.get()),
+                     const_cast<Grid<cell_t>*>(types.get()), 0};
+    fetch(fields);
+    multiple.velocity = velocity;
+    multiple.density = density;
+    multiple.types = types;
+    multiple.timestep_id = fields.timestep_id;
+    return multiple;
+}
 
+/* initialized is set once init() has returned, or to what it threw */
 void Simulation::SimulationImplementation::
-loop() {
-	init();
+loop(promise<void>* initialized) {
+	try {
+		init();
+	} catch(...) {
+		initialized->set_exception(current_exception());
+		return;
+	}
+	initialized->set_value();
+	timestamp = std::chrono::high_resolution_clock::now();
+	restart_schedule();
 	while(!join) {
-		for( size_t n = 0; n < iters; n++) {
-			one_iteration();
-		}
+		const size_t done = batch;
+		const auto start = std::chrono::high_resolution_clock::now();
+		iterate(done);
+		round_totals.iterate_seconds += seconds_since(start);
 
-		advance();
-    }
+		advance(done);
+		pace(done);
+	}
 }
 
+/* done is the number of iterations of the round, each of which performs
+ * timesteps_per_iteration() timesteps. */
 void Simulation::SimulationImplementation::
-advance() {
-    ++ts_id;
+advance(size_t done) {
+    ts_id += done * timesteps_per_iteration();
+    unpublished_steps += done * timesteps_per_iteration();
+    unpublished_changes = true;
 
     handle_requests();
+    publish();
+}
 
+/* Measures the round that just ended, which began at timestamp, waits
+ * until the next one is due and picks its iterations. A round takes
+ * at most about latency seconds, so that requests, which are only handled
+ * in between, wait no longer. The number of iterations grows by at most
+ * twice per round, so that a round that was unusually fast does not make
+ * the next one overshoot the latency.
+ *
+ * The rounds are due when the simulated time reaches speed times the time
+ * since schedule_start. A round that was late by more than latency, because
+ * the machine is too slow or the simulation was paused, starts a new
+ * schedule instead of being caught up on with a burst of rounds, which
+ * would stall the requests. The speed actually reachable is published as
+ * realtime_factor.
+ *
+ * For solvers that enqueue their steps asynchronously, the time of a round
+ * is the rate at which the device accepts them, which in the steady state
+ * is the rate at which it completes them. */
+void Simulation::SimulationImplementation::
+pace(size_t done) {
     using namespace std::chrono;
-    microseconds given_time(2000); // TODO calculate this properly
-   
+    auto now = high_resolution_clock::now();
+    const double compute_time = duration<double>(now - timestamp).count();
+    const double step = seconds_per_step();
+    if(compute_time > 0.0) {
+        iterations_per_second = done / compute_time;
+        steps_per_second = iterations_per_second * timesteps_per_iteration();
+        realtime_factor = step * iterations_per_second;
+        account(compute_time, done);
+    }
 
-	
-	milliseconds compute_time =
-		duration_cast<milliseconds>(high_resolution_clock::now() - timestamp);
-	
-	/*std::cout  << "" 
-			   <<  (gridHeight*gridWidth*iters) / 
-		(compute_time.count()-100) *1.0e-3
-		<< "  MLup/s \n";*/
-	//std::cout.flush();
-	timestamp = high_resolution_clock::now();
-	
-	
+    if(speed > 0.0 && step > 0.0) simulated += done * step;
+
+    // the requests handled while waiting may change the speed or the
+    // latency, then the wait ends and the next round is planned with them
+    const double waited_speed = speed;
+    const double waited_latency = latency;
+    while(speed > 0.0 && step > 0.0 && !pause && !join) {
+        const auto due = schedule_start + duration_cast<
+            high_resolution_clock::duration>(
+                duration<double>(simulated / speed));
+        if(now - due > duration<double>(latency)) {
+            restart_schedule();
+            break;
+        }
+        if(now >= due) break;
+        this_thread::sleep_for(min<high_resolution_clock::duration>(
+            due - now, duration_cast<high_resolution_clock::duration>(
+                duration<double>(latency))));
+        if(handle_requests()) unpublished_changes = true;
+        publish();
+        if(speed != waited_speed || latency != waited_latency) break;
+        now = high_resolution_clock::now();
+    }
 
-    while(pause) {
-        this_thread::sleep_for(given_time);
-        handle_requests();
+    microseconds given_time(2000);
+    if(pause && !join) {
+        while(pause && !join) {
+            this_thread::sleep_for(given_time);
+            if(handle_requests()) unpublished_changes = true;
+            publish();
+        }
+        restart_schedule();
     }
-}
 
+    double steps = iterations_per_second > 0.0
+        ? latency * iterations_per_second : 1.0;
+    if(speed > 0.0 && step > 0.0) {
+        // the iterations that keep up with speed during latency
+        steps = min(steps, latency * speed / step);
+    }
+    batch = (size_t)min(max(steps, 1.0), 2.0 * done);
+    timestamp = high_resolution_clock::now();
+}
 
+/* Adds the round that just ended to the rolling statistics and publishes
+ * them. The first round is taken as it is. */
+void Simulation::SimulationImplementation::
+account(double round_seconds, size_t done) {
+    round_totals.round_seconds = round_seconds;
+    round_totals.mlups = 1.0e-6 * gridWidth * gridHeight
+        * timesteps_per_iteration() * done / round_seconds;
+    if(round_totals.queue_depth > 0.0) round_totals.queue_latency /= round_totals.queue_depth;
+    if(perf.rounds == 0) {
+        perf = round_totals;
+    } else {
+        roll(perf.mlups, round_totals.mlups);
+        roll(perf.round_seconds, round_totals.round_seconds);
+        roll(perf.iterate_seconds, round_totals.iterate_seconds);
+        roll(perf.readback_seconds, round_totals.readback_seconds);
+        roll(perf.draw_seconds, round_totals.draw_seconds);
+        roll(perf.request_seconds, round_totals.request_seconds);
+        roll(perf.queue_depth, round_totals.queue_depth);
+        roll(perf.queue_latency, round_totals.queue_latency);
+        roll(perf.max_queue_latency, round_totals.max_queue_latency);
+    }
+    perf.rounds++;
+    round_totals = Simulation::perf_data();
 
+    Stats& next = stats.next();
+    next.perf = perf;
+    next.frame_time = frame_time;
+    stats.publish();
+}
 
 void Simulation::SimulationImplementation::
+restart_schedule() {
+    schedule_start = std::chrono::high_resolution_clock::now();
+    simulated = 0.0;
+}
+
+/* The physical time of one_iteration(), from the diffusion of momentum:
+ * the kinematic viscosity is cells squared per timestep for the solver,
+ * and square meters per second for the simulation. 0 if unknown. */
+auto Simulation::SimulationImplementation::
+seconds_per_step() -> double {
+    if(kinematic_viscosity <= 0.0 || gridWidth == 0) return 0.0;
+    const double cell = width / gridWidth;
+    return timesteps_per_iteration() * lattice_viscosity() * cell * cell
+        / kinematic_viscosity;
+}
+
+/* Takes the requests that are in the queue now, later ones wait for the
+ * next round, so that a flood of them can not starve the simulation.
+ * Returns whether there were any. */
+bool Simulation::SimulationImplementation::
 handle_requests() {
-    //multiple_mutex.lock();
-    lock_guard<mutex> lock1(todo_queue_mutex);
-    while(!todo_queue.empty()) {
-        todo_queue.front()();
-        todo_queue.pop();
+    Command command;
+    bool handled = false;
+    const auto start = chrono::high_resolution_clock::now();
+    const double nested = round_totals.readback_seconds + round_totals.draw_seconds;
+    const size_t end = todo_queue.claimed();
+    while(todo_queue.popped() < end && todo_queue.try_pop(command)) {
+        dequeued(command);
+        if(command.kind == Command::Kind::draw) {
+            const auto merge = chrono::high_resolution_clock::now();
+            coalesce_draws(command, end);
+            round_totals.draw_seconds += seconds_since(merge);
+        }
+        execute(command);
+        handled = true;
+    }
+    // the readbacks and draws among the requests are counted on their own
+    if(handled) {
+        round_totals.request_seconds += seconds_since(start)
+            - (round_totals.readback_seconds + round_totals.draw_seconds - nested);
     }
-    //multiple_mutex.unlock();
+    return handled;
+}
+
+void Simulation::SimulationImplementation::
+dequeued(const Command& command) {
+    const double waited = seconds_since(command.queued);
+    round_totals.queue_depth += 1.0;
+    round_totals.queue_latency += waited;
+    round_totals.max_queue_latency = max(round_totals.max_queue_latency, waited);
+}
+
+void Simulation::SimulationImplementation::
+read_fields(Grid<Vec2D<float>>* velocity, Grid<float>* density,
+            Grid<cell_t>* types) {
+    const auto start = chrono::high_resolution_clock::now();
+    get_fields(velocity, density, types);
+    round_totals.readback_seconds += seconds_since(start);
+}
+
+/* Fills the next frame in place of the one published three frames ago,
+ * whose grids go back to the pools first and are reused right away. A new
+ * frame is taken every publish_interval timesteps, whether the previous
+ * one has been read or not, so that readers always get one that old at
+ * most. Until somebody asks for the first frame, none is taken, which
+ * spares simulations without readers the readbacks. While paused, or if
+ * now is set, a new frame is published as soon as a request may have
+ * changed the fields. */
+void Simulation::SimulationImplementation::
+publish(bool now) {
+    if(!unpublished_changes || !frames_wanted) return;
+    if(!pause && !now && unpublished_steps < publish_interval) return;
+    Simulation::frame_data& frame = frames.next();
+    frame = Simulation::frame_data();
+    auto velocity = velocity_snapshots.acquire(gridWidth, gridHeight);
+    auto density = density_snapshots.acquire(gridWidth, gridHeight);
+    read_fields(const_cast<Grid<Vec2D<float>>*>(velocity.get()),
+                const_cast<Grid<float>*>(density.get()), nullptr);
+    frame.velocity = velocity;
+    frame.density = density;
+    frame.timestep_id = ts_id;
+    frame_time = chrono::high_resolution_clock::now();
+    frames.publish();
+    unpublished_steps = 0;
+    unpublished_changes = false;
+}
+
+void Simulation::SimulationImplementation::
+execute(Command& command) {
+    switch(command.kind) {
+    case Command::Kind::clear: {
+        const auto start = chrono::high_resolution_clock::now();
+        do_clear();
+        round_totals.draw_seconds += seconds_since(start);
+        break;
+    }
+    case Command::Kind::draw: {
+        const auto start = chrono::high_resolution_clock::now();
+        do_draw(command.x, command.y, command.mask_ptr, command.type);
+        round_totals.draw_seconds += seconds_since(start);
+        break;
+    }
+    case Command::Kind::steps:
+        do_steps(command.first);
+        break;
+    case Command::Kind::streaming:
+        do_streaming(command.mode);
+        break;
+    case Command::Kind::blocking:
+        do_blocking(command.first, command.second);
+        break;
+    case Command::Kind::threads:
+        do_threads(command.first, command.affinity);
+        break;
+    case Command::Kind::publishing:
+        publish_interval = command.first;
+        break;
+    case Command::Kind::speed:
+        speed = command.value;
+        restart_schedule();
+        break;
+    case Command::Kind::latency:
+        latency = command.value;
+        break;
+    case Command::Kind::frame:
+        publish(true);
+        command.result->set_value(nullptr);
+        break;
+    case Command::Kind::fields: {
+        Fields& fields = *static_cast<Fields*>(command.grid);
+        read_fields(fields.velocity, fields.density, fields.types);
+        fields.timestep_id = ts_id;
+        command.result->set_value(command.grid);
+        break;
+    }
+    }
+}
+
+/* Merges draw with the draws of the same type queued right behind it, up to
+ * the request end, into a single stroke, whose mask covers their bounding
+ * box and modifies every cell one of them does. Drawing is the same for
+ * every cell of a mask, so the result does not change, but the solver
+ * updates its geometry once instead of once per mouse event. */
+void Simulation::SimulationImplementation::
+coalesce_draws(Command& draw, size_t end) {
+    strokes.clear();
+    strokes.push_back(std::move(draw));
+    while(todo_queue.popped() < end) {
+        Command* next = todo_queue.front();
+        if(!next) break;
+        if(next->kind != Command::Kind::draw ||
+           next->type != strokes.front().type) break;
+        strokes.emplace_back();
+        todo_queue.try_pop(strokes.back());
+        dequeued(strokes.back());
+    }
+    if(strokes.size() == 1) {
+        draw = std::move(strokes.front());
+        return;
+    }
+
+    int left = INT_MAX, top = INT_MAX, right = INT_MIN, bottom = INT_MIN;
+    for(const Command& stroke : strokes) {
+        const Grid<mask_t>& mask = *stroke.mask_ptr;
+        const int x = stroke.x - (int)(mask.x() / 2);
+        const int y = stroke.y - (int)(mask.y() / 2);
+        left = min(left, x);
+        top = min(top, y);
+        right = max(right, x + (int)mask.x());
+        bottom = max(bottom, y + (int)mask.y());
+    }
+
+    auto merged = make_shared<Grid<mask_t>>(right - left, bottom - top);
+    for(size_t iy = 0; iy < merged->y(); ++iy) {
+        for(size_t ix = 0; ix < merged->x(); ++ix) {
+            (*merged)(ix, iy) = mask_t::IGNORE;
+        }
+    }
+    for(const Command& stroke : strokes) {
+        const Grid<mask_t>& mask = *stroke.mask_ptr;
+        const int x = stroke.x - (int)(mask.x() / 2) - left;
+        const int y = stroke.y - (int)(mask.y() / 2) - top;
+        for(size_t iy = 0; iy < mask.y(); ++iy) {
+            for(size_t ix = 0; ix < mask.x(); ++ix) {
+                if(mask(ix, iy) == mask_t::MODIFY)
+                    (*merged)(x + ix, y + iy) = mask_t::MODIFY;
+            }
+        }
+    }
+
+    draw = std::move(strokes.front());
+    // the solvers center the mask on x, y
+    draw.x = left + (int)(merged->x() / 2);
+    draw.y = top + (int)(merged->y() / 2);
+    draw.mask_ptr = merged;
+    strokes.clear();
 }
 
 void Simulation::SimulationImplementation::
@@ -333,6 +888,24 @@ do_steps(size_t steps) {
     stepsToDo += steps;
 }
 
+void Simulation::SimulationImplementation::
+iterate(size_t steps) {
+    for(size_t n = 0; n < steps; n++) {
+        one_iteration();
+    }
+}
+
+auto Simulation::SimulationImplementation::
+timesteps_per_iteration() -> size_t {
+    return 1;
+}
+
+void Simulation::SimulationImplementation::
+do_blocking(size_t, size_t) {}
+
+void Simulation::SimulationImplementation::
+do_threads(size_t, affinity_t) {}
+
 size_t
 Simulation::SimulationImplementation::
 get_gridWidth() {
@@ -363,6 +936,18 @@ get_timestep_id() {
     return ts_id;
 }
 
+double
+Simulation::SimulationImplementation::
+get_steps_per_second() {
+    return steps_per_second;
+}
+
+double
+Simulation::SimulationImplementation::
+get_realtime_factor() {
+    return realtime_factor;
+}
+
 std::ostream&
 operator<<(std::ostream &dest,
            Simulation::SimulationImplementation& sim) {
@@ -410,9 +995,9 @@ operator>>(std::istream &src,
 
 
 	std::ostream& operator<<(std::ostream& dest, const Cell& cell) {
-		dest << cell.NW << cell.N << cell.NE
-			 << cell.W << cell.C << cell.E
-			 << cell.SW << cell.S << cell.SE;
+		dest << cell.NW << " " << cell.N << " " << cell.NE << " "
+			 << cell.W  << " " << cell.C << " " << cell.E  << " "
+			 << cell.SW << " " << cell.S << " " << cell.SE << " ";
 		return dest;
 	}
 
@@ -16,7 +16,9 @@ You should have received a copy of the GNU Affero General Public License along
 with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include "core/SimulationUtilities.hpp"
+#include "core/lodepng.h"
 #include <cmath>
+#include <stdexcept>
 using namespace std;
 
 namespace Feldrand {
@@ -40,5 +42,27 @@ auto createCircleMask(int diameter) -> std::shared_ptr<const Grid<mask_t>> {
     return mask_ptr;
 }
 
+auto createImageMask(std::string filename) -> std::shared_ptr<const Grid<mask_t>> {
+    std::vector<unsigned char> image;
+    unsigned int width, height;
+    unsigned error = lodepng::decode(image, width, height, filename,
+                                     LodePNGColorType::LCT_GREY);
+    if(error) {
+        throw runtime_error(filename + ": " + lodepng_error_text(error));
+    }
+    auto mask_ptr = std::make_shared<Grid<mask_t>>(width, height);
+    Grid<mask_t>& mask = *mask_ptr;
+    for(size_t iy = 0; iy < height; ++iy) {
+        for(size_t ix = 0; ix < width; ++ix) {
+            if(image[iy * width + ix] != 0) {
+                mask(ix, iy) = mask_t::MODIFY;
+            } else {
+                mask(ix, iy) = mask_t::IGNORE;
+            }
+        }
+    }
+    return mask_ptr;
+}
+
 
 }
@@ -0,0 +1,41 @@
+enum cell_type {
+    FLUID = 0,
+    NO_SLIP = 1
+};
+
+/* One work item per cell of the mask, which is placed with its upper left
+ * corner at (left, top). Cells to MODIFY turn from fluid into no slip if
+ * to_obstacle is set, or from no slip into fluid otherwise. Both get the
+ * populations of fluid at rest, in the src and dst grids alike, which may be
+ * the same buffer. The layout is the one described in simulationStep.cl. */
+kernel void drawMask(int width, int height, int pitch,
+					 int left, int top,
+					 int mask_width, int mask_height,
+					 global const uchar* mask,
+					 int to_obstacle,
+					 global float* src,
+					 global float* dst,
+					 global int* flag_field) {
+
+	const int mx = get_global_id(0);
+	const int my = get_global_id(1);
+	if( mx >= mask_width || my >= mask_height ) return;
+	if( mask[my*mask_width + mx] == 0 ) return;
+
+	const int x = left + mx;
+	const int y = top + my;
+	if( x < 0 || x >= width || y < 0 || y >= height ) return;
+
+	const int index = y*pitch + x;
+	const int plane = pitch*height;
+	const int from = to_obstacle ? FLUID : NO_SLIP;
+	if( flag_field[index] != from ) return;
+	flag_field[index] = to_obstacle ? NO_SLIP : FLUID;
+
+	for( int i = 0; i < 9; i++) {
+		const float weight = i == 4 ? 4.0f / 9.0f :
+			(i % 2 == 1) ? 1.0f / 9.0f : 1.0f / 36.0f;
+		src[i*plane + index] = weight;
+		dst[i*plane + index] = weight;
+	}
+}
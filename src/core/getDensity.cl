@@ -1,28 +1,22 @@
-kernel void getDensity(global float* NW,
-						global float* N,
-						global float* NE,
-						global float* W,
-						global float* C,
-						global float* E,
-						global float* SW,
-						global float* S,
-						global float* SE,
+/* The populations are laid out as described in simulationStep.cl. density
+ * has no padding. */
+kernel void getDensity(global const float* f,
 						global float* density,
-						int width, int height ) {
+						int width, int height, int pitch ) {
 
     const int globalx = get_global_id(0);
     const int globaly = get_global_id(1);
 
-	const int index = globaly*width + globalx;
-
 	if( globalx < 0 || globalx >= width || 
 		globaly < 0 || globaly >= height) return;
 
-
-	density[index] = ( NW[index] + N[index] + NE[index] +
-					  W[index] + C[index] + E[index] + 
-					  SW[index] + S[index] + SE[index] );
-
-
+	const int index = globaly*width + globalx;
+	const int cell = globaly*pitch + globalx;
+	const int plane = pitch*height;
+
+	density[index] = ( f[0*plane + cell] + f[1*plane + cell] +
+					   f[2*plane + cell] + f[3*plane + cell] +
+					   f[4*plane + cell] + f[5*plane + cell] +
+					   f[6*plane + cell] + f[7*plane + cell] +
+					   f[8*plane + cell] );
 }
-
@@ -0,0 +1,38 @@
+/* The populations are laid out as described in simulationStep.cl. Both
+ * moments of a cell are computed from a single read of its populations and
+ * written interleaved, velocity x, velocity y and density, without
+ * padding. */
+kernel void getFields(global const float* f,
+					  global float* fields,
+					  int width, int height, int pitch ) {
+
+    const int globalx = get_global_id(0);
+    const int globaly = get_global_id(1);
+
+	if( globalx < 0 || globalx >= width ||
+		globaly < 0 || globaly >= height) return;
+
+	const int index = globaly*width + globalx;
+	const int cell = globaly*pitch + globalx;
+	const int plane = pitch*height;
+
+	const float NW = f[0*plane + cell];
+	const float N  = f[1*plane + cell];
+	const float NE = f[2*plane + cell];
+	const float W  = f[3*plane + cell];
+	const float C  = f[4*plane + cell];
+	const float E  = f[5*plane + cell];
+	const float SW = f[6*plane + cell];
+	const float S  = f[7*plane + cell];
+	const float SE = f[8*plane + cell];
+
+	fields[index*3    ] = ( NE - NW +
+							E - W +
+							SE - SW );
+
+	fields[index*3 + 1] = ( SW - NW +
+							S - N +
+							SE - NE );
+
+	fields[index*3 + 2] = ( NW + N + NE + W + C + E + SW + S + SE );
+}
@@ -1,29 +1,34 @@
-kernel void getVelocity(global float* NW,
-						global float* N,
-						global float* NE,
-						global float* W,
-						global float* C,
-						global float* E,
-						global float* SW,
-						global float* S,
-						global float* SE,
+/* The populations are laid out as described in simulationStep.cl: the
+ * planes of the directions NW, N, NE, W, C, E, SW, S, SE one after another,
+ * with rows pitch floats apart. vel has no padding. */
+kernel void getVelocity(global const float* f,
 						global float* vel,
-						int width, int height ) {
+						int width, int height, int pitch ) {
 
     const int globalx = get_global_id(0);
     const int globaly = get_global_id(1);
 
-	const int index = globaly*width + globalx;
-
 	if( globalx < 0 || globalx >= width || 
 		globaly < 0 || globaly >= height) return;
 
+	const int index = globaly*width + globalx;
+	const int cell = globaly*pitch + globalx;
+	const int plane = pitch*height;
+
+	const float NW = f[0*plane + cell];
+	const float N  = f[1*plane + cell];
+	const float NE = f[2*plane + cell];
+	const float W  = f[3*plane + cell];
+	const float E  = f[5*plane + cell];
+	const float SW = f[6*plane + cell];
+	const float S  = f[7*plane + cell];
+	const float SE = f[8*plane + cell];
 
-	vel[index*2    ] =  ( NE[index] - NW[index] + 
-						  E[index] - W[index] +
-						  SE[index] - SW[index] );
+	vel[index*2    ] =  ( NE - NW + 
+						  E - W +
+						  SE - SW );
 
-	vel[index*2 + 1] =  ( SW[index] - NW[index] +
-						  S[index] - N[index] +
-						  SE[index] - NE[index] );
+	vel[index*2 + 1] =  ( SW - NW +
+						  S - N +
+						  SE - NE );
 }
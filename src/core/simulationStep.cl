@@ -22,6 +22,10 @@ enum cell_type {
     COPY = 3
 };
 
+/* Directions are numbered in reading order, so that direction i points to
+ * the neighbor at DX(i), DY(i) and its opposite is 8 - i. All loops over the
+ * directions are unrolled, which turns every index below into a constant and
+ * keeps the populations in registers. */
 enum direction {
     NW = 0,
     N = 1,
@@ -29,187 +33,281 @@ enum direction {
     W = 3,
     C = 4,
     E = 5,
-    SE = 6,
+    SW = 6,
     S = 7,
-    SW = 8
+    SE = 8
 };
 
-kernel void simulationStep(int width, int height,
-                           global float* srcNW,
-                           global float* srcN,
-                           global float* srcNE,
-                           global float* srcW,
-                           global float* srcC,
-                           global float* srcE,
-                           global float* srcSW,
-                           global float* srcS,
-                           global float* srcSE,
-                           global float* destNW,
-                           global float* destN,
-                           global float* destNE,
-                           global float* destW,
-                           global float* destC,
-                           global float* destE,
-                           global float* destSW,
-                           global float* destS,
-                           global float* destSE,
-                           global int* flag_field) {
-
-
-    global float* dest[9];
-    global float* src[9];
-    dest[NW] = destNW;
-    dest[N] = destN;
-    dest[NE] = destNE;
-    dest[W] = destW;
-    dest[C] = destC;
-    dest[E] = destE;
-    dest[SW] = destSW;
-    dest[S] = destS;
-    dest[SE] = destSE;
-
-    src[NW] = srcNW;
-    src[N] = srcN;
-    src[NE] = srcNE;
-    src[W] = srcW;
-    src[C] = srcC;
-    src[E] = srcE;
-    src[SW] = srcSW;
-    src[S] = srcS;
-    src[SE] = srcSE;
-
-
-
-    const int globalx = get_global_id(0);
-    const int globaly = get_global_id(1);
-
-    const int index = globaly*width + globalx;
+#define DX(i) ((i) % 3 - 1)
+#define DY(i) ((i) / 3 - 1)
+#define OPPOSITE(i) (8 - (i))
+#define WEIGHT(i) ((i) == C ? 4.0f/9.0f : \
+                   (DX(i) == 0 || DY(i) == 0) ? 1.0f/9.0f : 1.0f/36.0f)
+
+/* The populations of a grid live in a single buffer. The plane of direction i
+ * starts at i * pitch * height, and rows are pitch floats apart, which keeps
+ * each row aligned. Flags and links use the same cell index y * pitch + x.
+ *
+ * The links of a cell hold, in bits 2i and 2i + 1, the cell type of its
+ * neighbor in direction i, and its own type for i = C. Cells beyond the grid
+ * count as no slip. A single load per cell replaces reading the flags of all
+ * nine cells, see computeLinks. */
+#define LINK(links, i) (((links) >> (2 * (i))) & 3)
+
+/* BGK_OCL builds this program with the grid's WIDTH, HEIGHT and PITCH as
+ * constants, which replace the kernel arguments of the same name and let the
+ * compiler fold the index arithmetic. HAS_SRC and HAS_COPY tell whether the
+ * grid holds cells of these types at all, if not their branches are dropped.
+ * OMEGA is the relaxation rate of the collision. The host side of a hybrid
+ * simulation compiles this file as C++ instead, see BGK_OCL.cpp, so it must
+ * stay within what both languages accept. */
+#ifdef WIDTH
+#define SPECIALIZE_GRID() width = WIDTH; height = HEIGHT; pitch = PITCH
+#else
+#define SPECIALIZE_GRID()
+#endif
+#ifndef HAS_SRC
+#define HAS_SRC 1
+#endif
+#ifndef HAS_COPY
+#define HAS_COPY 1
+#endif
+#ifndef OMEGA
+#define OMEGA 1.15f
+#endif
+
+/* BGK collision of the populations f of a single fluid cell */
+void collide(const float* f, float* ftemp) {
+    float rho = 0;
+
+    #pragma unroll
+    for( int i = 0; i < 9; i++) {
+        rho += f[i];
+    }
+
+    float ux = ( f[NE] - f[NW] +
+                 f[E] - f[W] +
+                 f[SE] - f[SW] );
+
+    float uy = ( f[SW] - f[NW] +
+                 f[S] - f[N] +
+                 f[SE] - f[NE] );
+
+    ux /= rho;
+    uy /= rho;
+
+    float usquare = ux*ux+uy*uy;
+
+    const float f1 = 3.0f;
+    const float f2 = 9.0f/2.0f;
+    const float f3 = 3.0f/2.0f;
+    const float diag = 1.0f/36.0f;
+    const float axis = 1.0f/9.0f;
+    const float center = 4.0f/9.0f;
+
+    float eq[9];
+
+    eq[NW] =
+        diag * rho * (1.0f + f1*(-ux-uy) + f2*(ux+uy)*(ux+uy) - f3* usquare);
+    eq[N] =
+        axis * rho * (1.0f + f1*(-uy) + f2*uy*uy - f3* usquare);
+    eq[NE] =
+        diag * rho * (1.0f + f1*(ux-uy) + f2*(ux-uy)*(ux-uy) - f3* usquare);
+    eq[W] =
+        axis * rho * (1.0f + f1*(-ux) + f2*ux*ux - f3*usquare);
+    eq[C] =
+        center * rho * (1.0f - f3*usquare);
+    eq[E] =
+        axis * rho * (1.0f + f1*(+ux) + f2*ux*ux - f3*usquare);
+    eq[SW] =
+        diag * rho * (1.0f + f1*(-ux+uy) + f2*(-ux+uy)*(-ux+uy) - f3* usquare);
+    eq[S] =
+        axis * rho * (1.0f + f1*(uy) + f2*uy*uy - f3* usquare);
+    eq[SE] =
+        diag * rho * (1.0f + f1*(ux+uy) + f2*(ux+uy)*(ux+uy) - f3* usquare);
+
+    #pragma unroll
+    for( int i = 0; i < 9; i++) {
+        ftemp[i] = f[i] - (f[i]-eq[i]) * OMEGA;
+    }
+}
+
+/* Recomputes the links of the cells in the rectangle of size w, h at left,
+ * top, which must be done whenever the flags of a cell in it or next to it
+ * have changed. */
+kernel void computeLinks(int width, int height, int pitch,
+                         int left, int top, int w, int h,
+                         global const int* restrict flag_field,
+                         global int* restrict links) {
+    SPECIALIZE_GRID();
+    const int x = left + get_global_id(0);
+    const int y = top + get_global_id(1);
+    if( get_global_id(0) >= w || get_global_id(1) >= h ||
+        x < 0 || x >= width || y < 0 || y >= height ) return;
+
+    int l = 0;
+    #pragma unroll
+    for( int i = 0; i < 9; i++) {
+        const int nx = x + DX(i);
+        const int ny = y + DY(i);
+        int type = NO_SLIP;
+        if( nx >= 0 && nx < width && ny >= 0 && ny < height) {
+            type = flag_field[ny*pitch + nx];
+        }
+        l |= type << (2 * i);
+    }
+    links[y*pitch + x] = l;
+}
+
+/* Both kernels are launched with one work group per tile that contains a
+ * cell other than no slip. tiles holds the x and y offset of each of them,
+ * the work group with id n handles the tile at tiles[2 * n]. */
+kernel void simulationStep(int width, int height, int pitch,
+                           global const float* restrict src,
+                           global float* restrict dest,
+                           global const int* restrict links,
+                           global const int* restrict tiles) {
+    SPECIALIZE_GRID();
+
+    const int globalx = tiles[2 * get_group_id(0)] + get_local_id(0);
+    const int globaly = tiles[2 * get_group_id(0) + 1] + get_local_id(1);
 
     if( globalx < 0 || globalx >= width ||
         globaly < 0 || globaly >= height ) return;
 
+    const int index = globaly*pitch + globalx;
+    const int plane = pitch*height;
+    const int l = links[index];
+    const int type = LINK(l, C);
 
+    if( type == NO_SLIP || (HAS_COPY && type == COPY)) return;
 
+    float f[9];
+    float ftemp[9];
+    #pragma unroll
+    for( int i = 0; i < 9; i++) {
+        f[i] = src[i*plane + index];
+    }
 
-    int dir_indices[9];
-    dir_indices[NW] = index - width - 1;
-    dir_indices[N]  = index - width;
-    dir_indices[NE] = index - width + 1;
-    dir_indices[W]  = index         - 1;
-    dir_indices[C]  = index;
-    dir_indices[E]  = index         + 1;
-    dir_indices[SW] = index + width - 1;
-    dir_indices[S]  = index + width;
-    dir_indices[SE] = index + width + 1;
+    if( !HAS_SRC || type == FLUID) {
+        collide(f, ftemp);
+    } else {
+        #pragma unroll
+        for( int i = 0; i < 9; i++) {
+            ftemp[i] = f[i];
+        }
+    }
 
-    if( flag_field[index] == NO_SLIP) return;
+    /* where a reflected and a copied population meet in one slot, the later
+     * direction wins */
+    #pragma unroll
+    for( int i = 0; i < 9; i++) {
+        const int to = LINK(l, i);
+        if( to == FLUID) {
+            dest[i*plane + index + DY(i)*pitch + DX(i)] = ftemp[i];
+        } else if( to == NO_SLIP) {
+            dest[OPPOSITE(i)*plane + index] = ftemp[i];
+        } else if( HAS_COPY && to == COPY) {
+            dest[i*plane + index] = ftemp[i];
+        }
+    }
+}
 
-    int opposite[9];
-    opposite[NW] = SE;
-    opposite[N] = S;
-    opposite[NE] = SW;
-    opposite[W] = E;
-    opposite[C] = C;
-    opposite[E] = W;
-    opposite[SW] = NE;
-    opposite[S] = N;
-    opposite[SE] = NW;
 
-    float ftemp[9];
+/* Whether simulationStep leaves a cell's outgoing population i in the cell
+ * itself, because it heads for a copy cell. If the population arriving from
+ * direction i was reflected by a no slip cell instead, simulationStep writes
+ * both into the same slot, and the later direction of its loop wins. */
+bool copies(int to_type, int from_type, int i) {
+    return HAS_COPY && to_type == COPY &&
+        (from_type != NO_SLIP || i > OPPOSITE(i));
+}
 
+/* In place counterpart of simulationStep (AA-pattern), working on a single
+ * set of populations. Two successive calls, with odd = 0 and odd = 1,
+ * perform the same two timesteps as two calls of simulationStep.
+ *
+ * The even step collides each fluid cell locally and stores the population
+ * heading in direction i in the slot of the opposite direction. The odd step
+ * then gathers the populations that the even step would have pushed to the
+ * cell, collides them and pushes the result to its fluid neighbors, which
+ * restores the natural order. Populations that no fluid neighbor delivers
+ * are filled in by the cell itself, according to the push rules of
+ * simulationStep: source cells are constant, no slip cells reflect and copy
+ * cells hand back the cell's own population. Slots that simulationStep never
+ * writes keep the lattice weights they were initialized with. Where a fluid
+ * or source neighbor streams into a slot that simulationStep also fills with
+ * a copy (a race between two work items there), streaming wins. */
+kernel void simulationStepAA(int width, int height, int pitch, int odd,
+                             global float* f,
+                             global const int* restrict links,
+                             global const int* restrict tiles) {
+    SPECIALIZE_GRID();
+
+    const int globalx = tiles[2 * get_group_id(0)] + get_local_id(0);
+    const int globaly = tiles[2 * get_group_id(0) + 1] + get_local_id(1);
 
-    if(flag_field[index] == COPY)
-        return;
+    if( globalx < 0 || globalx >= width ||
+        globaly < 0 || globaly >= height ) return;
 
-    if( flag_field[index] == FLUID) {
-        //Collide
-        float rho = 0;
+    const int index = globaly*pitch + globalx;
+    const int plane = pitch*height;
+    const int l = links[index];
 
-        for( size_t i = 0; i < 9; i++) {
-            rho += src[i][index];
-        }
+    if( LINK(l, C) != FLUID) return;
 
-        float ux = ( src[NE][index] - src[NW][index] +
-                     src[E][index] - src[W][index] +
-                     src[SE][index] - src[SW][index] );
-
-        float uy = ( src[SW][index] - src[NW][index] +
-                     src[S][index] - src[N][index] +
-                     src[SE][index] - src[NE][index] );
-
-        ux /= rho;
-        uy /= rho;
-
-        float usquare = ux*ux+uy*uy;
-
-        const float f1 = 3.0f;
-        const float f2 = 9.0f/2.0f;
-        const float f3 = 3.0f/2.0f;
-        const float diag = 1.0f/36.0f;
-        const float axis = 1.0f/9.0f;
-        const float center = 4.0f/9.0f;
-
-        float eq[9];
-
-        eq[NW] =
-            diag * rho * (1.0f + f1*(-ux-uy) + f2*(ux+uy)*(ux+uy) - f3* usquare);
-        eq[N] =
-            axis * rho * (1.0f + f1*(-uy) + f2*uy*uy - f3* usquare);
-        eq[NE] =
-            diag * rho * (1.0f + f1*(ux-uy) + f2*(ux-uy)*(ux-uy) - f3* usquare);
-        eq[W] =
-            axis * rho * (1.0f + f1*(-ux) + f2*ux*ux - f3*usquare);
-        eq[C] =
-            center * rho * (1.0f - f3*usquare);
-        eq[E] =
-            axis * rho * (1.0f + f1*(+ux) + f2*ux*ux - f3*usquare);
-        eq[SW] =
-            diag * rho * (1.0f + f1*(-ux+uy) + f2*(-ux+uy)*(-ux+uy) - f3* usquare);
-        eq[S] =
-            axis * rho * (1.0f + f1*(uy) + f2*uy*uy - f3* usquare);
-        eq[SE] =
-            diag * rho * (1.0f + f1*(ux+uy) + f2*(ux+uy)*(ux+uy) - f3* usquare);
-
-        for( size_t i = 0; i < 9;i++) {
-            ftemp[i] = src[i][index] - (src[i][index]-eq[i]) * 1.15f;
-        }
+    float fcell[9];
+    float ftemp[9];
 
-    } else if( flag_field[index] == SRC) {
-        for( size_t i = 0; i < 9; i++) {
-            ftemp[i] = src[i][index];
+    if( !odd) {
+        #pragma unroll
+        for( int i = 0; i < 9; i++) {
+            fcell[i] = f[i*plane + index];
         }
+        collide(fcell, ftemp);
+        #pragma unroll
+        for( int i = 0; i < 9; i++) {
+            f[OPPOSITE(i)*plane + index] = ftemp[i];
+        }
+        return;
     }
-    /*
-    if( globalx == 2 && globaly == 10) {
 
-        for( size_t i = 0; i < 3; i++) {
-            printf("%f %f %f\n",
-                   src[i*3][index], src[i*3+1][index], src[i*3+2][index]);
+    /* the population arriving from direction i comes from the neighbor in
+     * direction OPPOSITE(i) */
+    #pragma unroll
+    for( int i = 0; i < 9; i++) {
+        const int from = index - DY(i)*pitch - DX(i);
+        const int from_type = LINK(l, OPPOSITE(i));
+        if( from_type == FLUID) {
+            fcell[i] = f[OPPOSITE(i)*plane + from];
+        } else if( HAS_SRC && from_type == SRC) {
+            fcell[i] = f[i*plane + from];
+        } else if( copies(LINK(l, i), from_type, i)) {
+            fcell[i] = f[OPPOSITE(i)*plane + index];
+        } else if( from_type == NO_SLIP) {
+            fcell[i] = f[i*plane + index];
+        } else {
+            fcell[i] = WEIGHT(i);
         }
-        printf("\n");
-        for( size_t i = 0; i < 3; i++) {
-            printf("%f %f %f\n", ftemp[i*3], ftemp[i*3+1], ftemp[i*3+2]);
+    }
+    collide(fcell, ftemp);
+
+    #pragma unroll
+    for( int i = 0; i < 9; i++) {
+        const int to_type = LINK(l, i);
+        const int from_type = LINK(l, OPPOSITE(i));
+        if( to_type == FLUID) {
+            f[i*plane + index + DY(i)*pitch + DX(i)] = ftemp[i];
         }
-        printf("\n\n");
-
-    }*/
-
-    if( flag_field[index] != NO_SLIP) {
-
-        for( size_t i = 0; i < 9; i++) {
-            if( flag_field[dir_indices[i]] == FLUID) {
-                dest[i][dir_indices[i]] = ftemp[i];
-            } else if( flag_field[dir_indices[i]] == NO_SLIP) {
-                dest[opposite[i]][index] = ftemp[i];
-            }
-            if( flag_field[dir_indices[i]] == COPY) {
-                dest[i][index] = ftemp[i];
-            }
+        if( from_type == FLUID) continue;
+        if( HAS_SRC && from_type == SRC) {
+            f[i*plane + index] = fcell[i];
+        } else if( copies(to_type, from_type, i)) {
+            f[i*plane + index] = ftemp[i];
+        } else if( from_type == NO_SLIP) {
+            f[i*plane + index] = ftemp[OPPOSITE(i)];
+        } else {
+            f[i*plane + index] = WEIGHT(i);
         }
     }
-
-    return;
-
 }
-
-
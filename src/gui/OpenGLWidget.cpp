@@ -207,14 +207,14 @@ OpenGLWidget::draw() {
     //lock_guard<mutex> lock(renderMutex);
     if(!sim) return false;
 
-    sim->beginMultiple();
-    auto v = sim->get<Grid<Vec2D<float>>*>(Simulation::Data::velocity_grid);
-    auto d = sim->get<Grid<float>*>(Simulation::Data::density_grid);
+    // the latest frame, the simulation keeps running meanwhile
+    Simulation::frame_data frame =
+        sim->get<Simulation::frame_data>(Simulation::Data::frame);
     //auto t = sim->get<Grid<cell_t>*>(Simulation::Data::type_grid);
-    sim->endMultiple();
 
-    vel_ptr = shared_ptr<const Grid<Vec2D<float>>>((Grid<Vec2D<float>>*)v);
-    dens_ptr = shared_ptr<const Grid<float>>((Grid<float>*)d);
+    vel_ptr = frame.velocity;
+    dens_ptr = frame.density;
+
     return redraw();
 
     
@@ -222,17 +222,6 @@ OpenGLWidget::draw() {
 
 bool
 OpenGLWidget::redraw() {
-
-	using namespace std::chrono;
-	
-	milliseconds duration1 = duration_cast<milliseconds>
-		(high_resolution_clock::now()-timestamp);
-	
-
-	std::chrono::time_point<std::chrono::high_resolution_clock> redraw_start =
-		std::chrono::high_resolution_clock::now();
-	
-
     glColor3f(1.0, 1.0, 1.0);
     glClear(GL_COLOR_BUFFER_BIT |
 			GL_DEPTH_BUFFER_BIT);
@@ -247,15 +236,6 @@ OpenGLWidget::redraw() {
 
 
 	(*drawing_routine)(*vel_ptr, *dens_ptr);
-	
-	
-	milliseconds duration2 = duration_cast<milliseconds>
-		(high_resolution_clock::now() - redraw_start);
-
-	//std::cout << duration1.count() << "ms    " 
-	//		  << duration2.count() << "ms                  ";
-
-	timestamp = chrono::high_resolution_clock::now();
 
     return true;
 }